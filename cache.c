@@ -0,0 +1,753 @@
+/* cache.c - LRU sector cache for the SD driver                         */
+/*                                                                      */
+/* This program is free software; you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation; either version 2 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This program is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT- */
+/* ABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General    */
+/* Public License for more details.                                     */
+/*                                                                      */
+/*   DOS re-reads the same FAT and directory sectors over and over, and */
+/* every one of those costs a full bit-banged SPI transfer.  This keeps */
+/* the most recently used sectors in memory:                            */
+/*                                                                      */
+/*  - The slot buffers live past transient_data, in the memory that     */
+/*    deviceInit() would otherwise hand back to DOS, one sector per     */
+/*    32 paragraphs so a slot is addressed by segment alone.            */
+/*  - A slot is found by hashing its LBN into CACHE_BUCKETS chains, and */
+/*    the least recently used slot is the one that gets replaced.       */
+/*  - Writes go straight through to the card and cached copies of the  */
+/*    written sectors are updated.  With /L=n small writes are instead  */
+/*    held dirty, up to n sectors, and then flushed sorted by LBN so    */
+/*    that runs of neighbouring sectors go out as one CMD25.            */
+/*  - Only small requests (FAT, directory) are copied into the cache;   */
+/*    big file transfers are looked up but would only flush it.         */
+/*  - FAT #1 and the root directory of the mounted volume have a fixed  */
+/*    shadow of their own, so once read they never go over SPI again.   */
+/*  - Sectors can be pinned, either listed with /R=lbn,count on the     */
+/*    DEVICE= line and preloaded at boot, or at runtime through IOCTL   */
+/*    output.  A pinned slot is taken off the LRU list, so it is never  */
+/*    replaced until it is unpinned.                                    */
+/*  - With /A a read that ends on a cluster boundary in the data area   */
+/*    looks the next cluster up in the cached FAT and reads it into     */
+/*    slots ahead of DOS, which follows fragmented files too.           */
+
+#include <stdio.h>      /* needed for NULL, etc       */
+#include <mem.h>        /* memset, memcopy, etc       */
+#include <stdint.h>     /* uint8_t, uint16_t, etc     */
+#include <dos.h>        /* MK_FP, FP_SEG, FP_OFF      */
+
+#include "sd.h"         /* device protocol and data defintions */
+#include "diskio.h"     /* stuff from sdmm.c module */
+#include "cache.h"
+
+#define CACHE_BUCKETS  32          /* Hash chains, power of two */
+#define CACHE_FILL_MAX 2           /* Largest request copied into the cache */
+
+#define NIL        0xFF            /* End of a hash chain or LRU list */
+#define FREE_LBN   0xFFFFFFFFUL    /* slot_lbn of an unused slot */
+
+#define HASH(lbn)    ((uint8_t)(lbn) & (CACHE_BUCKETS - 1))
+#define SLOT_PTR(i)  ((uint8_t far *)MK_FP(cache_seg + (uint16_t)(i) * (BLOCKSIZE >> 4), 0))
+
+uint16_t cache_slots = CACHE_DEFAULT_SLOTS;
+uint32_t cache_hits = 0;
+uint32_t cache_misses = 0;
+
+static uint16_t cache_seg;                      /* Segment of slot 0 */
+static uint32_t slot_lbn[CACHE_MAX_SLOTS];      /* LBN held, FREE_LBN if none */
+static uint8_t hash_next[CACHE_MAX_SLOTS];      /* Next slot in the same chain */
+static uint8_t hash_head[CACHE_BUCKETS];        /* First slot of each chain */
+static uint8_t lru_prev[CACHE_MAX_SLOTS];       /* Towards the most recent */
+static uint8_t lru_next[CACHE_MAX_SLOTS];       /* Towards the least recent */
+static uint8_t lru_head = NIL;                  /* Most recently used */
+static uint8_t lru_tail = NIL;                  /* Next one to be replaced */
+
+/* The root directory and FAT #1 are shadowed whole (as far as /F=n    */
+/* allows) instead of competing for slots.  Shadow sector k is at      */
+/* shadow_seg + k*32; the root directory comes first, then the FAT.    */
+#define NO_SHADOW        0xFFFF
+#define SHADOW_VALID(k)  (shadow_valid[(k) >> 3] & (1 << ((k) & 7)))
+#define SHADOW_PTR(k)    ((uint8_t far *)MK_FP(shadow_seg + (k) * (BLOCKSIZE >> 4), 0))
+
+uint16_t shadow_max = SHADOW_DEFAULT_SECTORS;
+
+static uint16_t shadow_seg;                     /* Segment of shadow sector 0 */
+static uint16_t shadow_secs;                    /* root_secs + fat_secs */
+static uint32_t root_lbn;                       /* First root directory sector */
+static uint16_t root_secs;                      /* Root directory sectors held */
+static uint32_t fat_lbn;                        /* First sector of FAT #1 */
+static uint16_t fat_secs;                       /* FAT #1 sectors held */
+static uint8_t shadow_valid[(SHADOW_MAX_SECTORS + 7) / 8];  /* Loaded yet? */
+
+/* Write-back state.  A dirty sector is always held in a slot or in the */
+/* shadow, never both.  Since only requests of up to CACHE_FILL_MAX     */
+/* sectors are held back and a flush follows as soon as dirty_count     */
+/* reaches dirty_limit, there are never more than DIRTY_MAX of them.    */
+#define DIRTY_MAX        (CACHE_MAX_SLOTS + CACHE_FILL_MAX)
+#define SHADOW_DIRTY(k)  (shadow_dirty[(k) >> 3] & (1 << ((k) & 7)))
+#define SHADOW_REF       0x8000    /* dirty_ref[] flag: k is a shadow index */
+
+uint16_t dirty_limit = 0;
+
+static uint16_t dirty_count;                    /* Sectors not on the card yet */
+static uint16_t cache_unit;                     /* Unit the dirty sectors belong to */
+static bool slot_dirty[CACHE_MAX_SLOTS];
+static uint8_t shadow_dirty[(SHADOW_MAX_SECTORS + 7) / 8];
+static uint32_t dirty_lbn[DIRTY_MAX];           /* cache_flush() work list */
+static uint16_t dirty_ref[DIRTY_MAX];
+
+/* FAT-chain prefetch.  The volume geometry comes from shadow_init().   */
+bool prefetch_on = false;
+uint32_t prefetch_count = 0;
+uint32_t prefetch_hits = 0;
+uint32_t prefetch_wasted = 0;
+
+static uint32_t data_lbn;                       /* Sector of cluster 2 */
+static uint8_t clus_secs;                       /* Sectors per cluster */
+static uint16_t max_clus;                       /* Highest valid cluster number */
+static bool fat12;                              /* else FAT16 */
+static bool slot_prefetched[CACHE_MAX_SLOTS];   /* Read ahead, not used yet */
+
+/* Pinning.  At least CACHE_MIN_LRU slots always stay replaceable.      */
+#define CACHE_MIN_LRU    4
+
+uint16_t pinned_count = 0;
+
+static bool slot_pinned[CACHE_MAX_SLOTS];       /* Off the LRU list */
+static uint8_t preload_n = 0;                   /* /R ranges still to load */
+static uint16_t preload_lbn[PRELOAD_MAX];
+static uint16_t preload_len[PRELOAD_MAX];
+
+
+static
+void lru_unlink (uint8_t i)
+{
+   if (lru_prev[i] != NIL) lru_next[lru_prev[i]] = lru_next[i];
+   else lru_head = lru_next[i];
+   if (lru_next[i] != NIL) lru_prev[lru_next[i]] = lru_prev[i];
+   else lru_tail = lru_prev[i];
+}
+
+static
+void lru_link_head (uint8_t i)
+{
+   lru_prev[i] = NIL;
+   lru_next[i] = lru_head;
+   if (lru_head != NIL) lru_prev[lru_head] = i;
+   lru_head = i;
+   if (lru_tail == NIL) lru_tail = i;
+}
+
+static
+void lru_to_head (uint8_t i)
+{
+   if (lru_head == i || slot_pinned[i]) return;
+   lru_unlink(i);
+   lru_prev[i] = NIL;
+   lru_next[i] = lru_head;
+   if (lru_head != NIL) lru_prev[lru_head] = i;
+   lru_head = i;
+   if (lru_tail == NIL) lru_tail = i;
+}
+
+static
+void lru_to_tail (uint8_t i)
+{
+   if (slot_pinned[i]) {            /* Back on the list, at the end */
+      slot_pinned[i] = false;
+      pinned_count--;
+      lru_next[i] = NIL;
+      lru_prev[i] = lru_tail;
+      if (lru_tail != NIL) lru_next[lru_tail] = i;
+      lru_tail = i;
+      if (lru_head == NIL) lru_head = i;
+      return;
+   }
+   if (lru_tail == i) return;
+   lru_unlink(i);
+   lru_next[i] = NIL;
+   lru_prev[i] = lru_tail;
+   if (lru_tail != NIL) lru_next[lru_tail] = i;
+   lru_tail = i;
+   if (lru_head == NIL) lru_head = i;
+}
+
+static
+void hash_unlink (uint8_t i)
+{
+   uint8_t *p = &hash_head[HASH(slot_lbn[i])];
+
+   while (*p != NIL) {
+      if (*p == i) {
+         *p = hash_next[i];
+         return;
+      }
+      p = &hash_next[*p];
+   }
+}
+
+/* Slot holding lbn, or NIL.  Does not count as a use. */
+static
+uint8_t find_slot (uint32_t lbn)
+{
+   uint8_t i;
+
+   for (i = hash_head[HASH(lbn)]; i != NIL; i = hash_next[i])
+      if (slot_lbn[i] == lbn) return i;
+   return NIL;
+}
+
+/* Take the least recently used slot over for lbn.  If that slot still */
+/* holds a dirty sector everything dirty is flushed first; NIL if that  */
+/* failed and the slot could not be freed.                              */
+static
+uint8_t claim_slot (uint32_t lbn)
+{
+   uint8_t i = lru_tail;
+
+   if (i == NIL) return NIL;
+   if (slot_dirty[i]) {
+      cache_flush();
+      i = lru_tail;
+      if (slot_dirty[i]) return NIL;
+   }
+   if (slot_prefetched[i]) {
+      slot_prefetched[i] = false;
+      prefetch_wasted++;
+   }
+   if (slot_lbn[i] != FREE_LBN) hash_unlink(i);
+   slot_lbn[i] = lbn;
+   hash_next[i] = hash_head[HASH(lbn)];
+   hash_head[HASH(lbn)] = i;
+   lru_to_head(i);
+   return i;
+}
+
+/* Empty a slot and make it the first to be reused */
+static
+void drop_slot (uint8_t i)
+{
+   if (slot_dirty[i]) {
+      slot_dirty[i] = false;
+      dirty_count--;
+   }
+   if (slot_prefetched[i]) {
+      slot_prefetched[i] = false;
+      prefetch_wasted++;
+   }
+   hash_unlink(i);
+   slot_lbn[i] = FREE_LBN;
+   lru_to_tail(i);
+}
+
+
+/* cache_invalidate */
+void cache_invalidate (void)
+{
+   uint8_t i;
+
+   _fmemset(shadow_valid, 0, sizeof(shadow_valid));
+   _fmemset(shadow_dirty, 0, sizeof(shadow_dirty));
+   dirty_count = 0;
+   for (i = 0; i < CACHE_BUCKETS; i++) hash_head[i] = NIL;
+   for (i = 0; i < cache_slots; i++) {
+      slot_lbn[i] = FREE_LBN;
+      slot_dirty[i] = false;
+      slot_prefetched[i] = false;
+      slot_pinned[i] = false;
+      lru_prev[i] = i ? i - 1 : NIL;
+      lru_next[i] = (i + 1 < cache_slots) ? i + 1 : NIL;
+   }
+   lru_head = cache_slots ? 0 : NIL;
+   lru_tail = cache_slots ? (uint8_t)(cache_slots - 1) : NIL;
+   pinned_count = 0;
+}
+
+/* shadow_init */
+/*   Called from deviceInit() once find_volume() has filled in the BPB.  */
+/* Notes where the FAT, root directory and data area are, and works out  */
+/* FAT12 or FAT16 the way DOS does, from the cluster count.  Then        */
+/* reserves room for the root directory and then as much of FAT #1 as    */
+/* fits in shadow_max sectors, right after the cache slots.  Sectors are */
+/* loaded the first time DOS reads them; like the slots, the shadow      */
+/* cannot be filled during init because it overlaps the init code.       */
+void far *shadow_init (void far *endaddr, bpb far *bpb)
+{
+   uint16_t n;
+   uint32_t nclus;
+
+   shadow_secs = root_secs = fat_secs = 0;
+   _fmemset(shadow_valid, 0, sizeof(shadow_valid));
+   if (shadow_max > SHADOW_MAX_SECTORS) shadow_max = SHADOW_MAX_SECTORS;
+
+   fat_lbn = bpb->bpb_nreserved;
+   root_lbn = fat_lbn + (uint32_t)bpb->bpb_nfat * bpb->bpb_nfsect;
+   n = (bpb->bpb_ndirent + (BLOCKSIZE / 32) - 1) / (BLOCKSIZE / 32);
+   data_lbn = root_lbn + n;
+   clus_secs = bpb->bpb_nsector;
+   nclus = (clus_secs && bpb->bpb_nsize > data_lbn) ?
+      (bpb->bpb_nsize - data_lbn) / clus_secs : 0;
+   if (nclus > 0xFFF5UL) nclus = 0xFFF5UL;
+   max_clus = nclus ? (uint16_t)nclus + 1 : 0;  /* 0: no prefetch */
+   fat12 = (nclus < 4085);
+   root_secs = (n < shadow_max) ? n : shadow_max;
+   n = shadow_max - root_secs;
+   fat_secs = (bpb->bpb_nfsect < n) ? bpb->bpb_nfsect : n;
+   shadow_secs = root_secs + fat_secs;
+   shadow_max = shadow_secs;        /* What was actually reserved */
+
+   shadow_seg = FP_SEG(endaddr) + ((FP_OFF(endaddr) + 15) >> 4);
+   if (!shadow_secs) return endaddr;
+   return MK_FP(shadow_seg + shadow_secs * (BLOCKSIZE >> 4), 0);
+}
+
+/* cache_init */
+/*   Called once from deviceInit().  The slots start at the first        */
+/* paragraph at or after endaddr; the returned pointer is what DOS must  */
+/* be told is the end of the resident driver.  Nothing is written to the */
+/* slots here, since until init returns they overlap the init code.     */
+void far *cache_init (void far *endaddr)
+{
+   if (cache_slots > CACHE_MAX_SLOTS) cache_slots = CACHE_MAX_SLOTS;
+   cache_seg = FP_SEG(endaddr) + ((FP_OFF(endaddr) + 15) >> 4);
+   cache_hits = cache_misses = 0;
+   cache_invalidate();
+   if (!cache_slots) dirty_limit = 0;    /* Nowhere to hold dirty sectors */
+   if (dirty_limit > CACHE_MAX_SLOTS) dirty_limit = CACHE_MAX_SLOTS;
+   if (!cache_slots) return endaddr;
+   return MK_FP(cache_seg + cache_slots * (BLOCKSIZE >> 4), 0);
+}
+
+/* Index of lbn in the shadow, or NO_SHADOW */
+static
+uint16_t shadow_index (uint32_t lbn)
+{
+   if (lbn >= root_lbn && lbn < root_lbn + root_secs)
+      return (uint16_t)(lbn - root_lbn);
+   if (lbn >= fat_lbn && lbn < fat_lbn + fat_secs)
+      return root_secs + (uint16_t)(lbn - fat_lbn);
+   return NO_SHADOW;
+}
+
+/* Is lbn held anywhere?  Does not count as a use. */
+static
+bool is_cached (uint32_t lbn)
+{
+   uint16_t k = shadow_index(lbn);
+
+   if (k != NO_SHADOW) return SHADOW_VALID(k);
+   return find_slot(lbn) != NIL;
+}
+
+/* Copy of lbn in memory, or NULL.  Counts as a use. */
+static
+uint8_t far *cached_copy (uint32_t lbn)
+{
+   uint16_t k = shadow_index(lbn);
+   uint8_t i;
+
+   if (k != NO_SHADOW)
+      return SHADOW_VALID(k) ? SHADOW_PTR(k) : NULL;
+   i = find_slot(lbn);
+   if (i == NIL) return NULL;
+   lru_to_head(i);
+   if (slot_prefetched[i]) {
+      slot_prefetched[i] = false;
+      prefetch_hits++;
+   }
+   return SLOT_PTR(i);
+}
+
+/* Copy data in as the contents of lbn.  Sectors in the shadow are    */
+/* always kept; others only get a slot if fill is set or they already  */
+/* had one.  dirty says whether the card still has to be written; a    */
+/* clean copy replaces a dirty one, as the card now has the newer data.*/
+/* Returns false if a dirty sector found nowhere to stay.              */
+static
+bool keep_copy (uint32_t lbn, const uint8_t far *data, bool fill, bool dirty)
+{
+   uint16_t k = shadow_index(lbn);
+   uint8_t i, bit;
+
+   if (k != NO_SHADOW) {
+      _fmemcpy(SHADOW_PTR(k), data, BLOCKSIZE);
+      bit = 1 << (k & 7);
+      shadow_valid[k >> 3] |= bit;
+      if (dirty && !(shadow_dirty[k >> 3] & bit)) dirty_count++;
+      if (!dirty && (shadow_dirty[k >> 3] & bit)) dirty_count--;
+      if (dirty) shadow_dirty[k >> 3] |= bit;
+      else shadow_dirty[k >> 3] &= ~bit;
+      return true;
+   }
+   if (!cache_slots) return !dirty;
+   i = find_slot(lbn);
+   if (i != NIL) lru_to_head(i);
+   else if (fill) i = claim_slot(lbn);
+   if (i == NIL) return !dirty;
+   _fmemcpy(SLOT_PTR(i), data, BLOCKSIZE);
+   if (dirty != slot_dirty[i]) {
+      slot_dirty[i] = dirty;
+      if (dirty) dirty_count++;
+      else dirty_count--;
+   }
+   return true;
+}
+
+/* Is lbn held dirty anywhere? */
+static
+bool is_dirty (uint32_t lbn)
+{
+   uint16_t k = shadow_index(lbn);
+   uint8_t i;
+
+   if (k != NO_SHADOW) return SHADOW_DIRTY(k) != 0;
+   if (!cache_slots || (i = find_slot(lbn)) == NIL) return false;
+   return slot_dirty[i];
+}
+
+/* Forget lbn, its contents on the card are unknown */
+static
+void drop_copy (uint32_t lbn)
+{
+   uint16_t k = shadow_index(lbn);
+   uint8_t i, bit;
+
+   if (k != NO_SHADOW) {
+      bit = 1 << (k & 7);
+      if (shadow_dirty[k >> 3] & bit) dirty_count--;
+      shadow_valid[k >> 3] &= ~bit;
+      shadow_dirty[k >> 3] &= ~bit;
+      return;
+   }
+   if (cache_slots && (i = find_slot(lbn)) != NIL) drop_slot(i);
+}
+
+/* cache_flush */
+/*   Writes every dirty sector to the card in ascending LBN order.  Each */
+/* run of consecutive LBNs is opened as one CMD25 with sd_write_begin() */
+/* and fed a sector at a time from wherever the copies live, and the     */
+/* write stream is closed at the end so that everything is programmed.  */
+/* A sector stays dirty if its write fails, and the error is returned.   */
+int cache_flush (void)
+{
+   uint16_t n, nd, j, k, ref;
+   uint32_t lbn;
+   uint8_t i;
+   uint8_t far *data;
+   int status = RES_OK;
+
+   if (!dirty_count) return sd_flush(cache_unit);
+
+   /* Gather the dirty sectors, insertion sorted by LBN */
+   nd = 0;
+   for (n = 0; n < cache_slots + shadow_secs && nd < DIRTY_MAX; n++) {
+      if (n < cache_slots) {
+         if (!slot_dirty[n]) continue;
+         lbn = slot_lbn[n];
+         ref = n;
+      }
+      else {
+         k = n - cache_slots;
+         if (!SHADOW_DIRTY(k)) continue;
+         lbn = (k < root_secs) ? root_lbn + k : fat_lbn + (k - root_secs);
+         ref = SHADOW_REF | k;
+      }
+      for (j = nd; j && dirty_lbn[j - 1] > lbn; j--) {
+         dirty_lbn[j] = dirty_lbn[j - 1];
+         dirty_ref[j] = dirty_ref[j - 1];
+      }
+      dirty_lbn[j] = lbn;
+      dirty_ref[j] = ref;
+      nd++;
+   }
+
+   for (n = 0; n < nd; n++) {
+      lbn = dirty_lbn[n];
+      ref = dirty_ref[n];
+      if (n + 1 < nd && dirty_lbn[n + 1] == lbn + 1 &&
+          (n == 0 || dirty_lbn[n - 1] + 1 != lbn))
+         sd_write_begin(cache_unit, lbn);        /* Start of a run */
+      data = (ref & SHADOW_REF) ? SHADOW_PTR(ref & ~SHADOW_REF) : SLOT_PTR(ref);
+      if (sd_write(cache_unit, lbn, data, 1) != RES_OK) {
+         status = RES_ERROR;
+         continue;
+      }
+      if (ref & SHADOW_REF) {
+         k = ref & ~SHADOW_REF;
+         shadow_dirty[k >> 3] &= ~(1 << (k & 7));
+      }
+      else {
+         i = (uint8_t)ref;
+         slot_dirty[i] = false;
+      }
+      dirty_count--;
+   }
+   if (sd_flush(cache_unit) != RES_OK) status = RES_ERROR;
+   return status;
+}
+
+/* Byte off of FAT #1 if its sector is in memory, else -1 */
+static
+int fat_byte (uint32_t off)
+{
+   uint32_t lbn = fat_lbn + (off >> 9);
+   uint16_t k = shadow_index(lbn);
+   uint8_t i;
+
+   if (k != NO_SHADOW)
+      return SHADOW_VALID(k) ? SHADOW_PTR(k)[(uint16_t)off & (BLOCKSIZE - 1)] : -1;
+   if (!cache_slots || (i = find_slot(lbn)) == NIL) return -1;
+   return SLOT_PTR(i)[(uint16_t)off & (BLOCKSIZE - 1)];
+}
+
+/* Cluster after clus in its chain, 0 if end of chain or FAT not cached */
+static
+uint16_t next_cluster (uint16_t clus)
+{
+   uint32_t off;
+   int lo, hi;
+   uint16_t v;
+
+   off = fat12 ? (uint32_t)clus + (clus >> 1) : (uint32_t)clus * 2;
+   if ((lo = fat_byte(off)) < 0 || (hi = fat_byte(off + 1)) < 0) return 0;
+   v = (uint16_t)lo | ((uint16_t)hi << 8);
+   if (fat12) v = (clus & 1) ? v >> 4 : v & 0x0FFF;
+   if (v < 2 || v > max_clus) return 0;
+   return v;
+}
+
+/* Read ahead the cluster that follows the one ending at sector last,   */
+/* as far as the FAT in memory tells.  Each run of sectors not cached   */
+/* yet is opened as one CMD18 with sd_read_begin() and read a sector at */
+/* a time into its slot; if the cluster is the adjacent one, the CMD18  */
+/* left open by the DOS read just carries on into it.                   */
+static
+void prefetch (uint16_t unit, uint32_t last)
+{
+   uint16_t clus, next, n;
+   uint32_t lbn, prev = FREE_LBN;
+   uint8_t i;
+
+   if (!max_clus || last < data_lbn) return;
+   if ((last - data_lbn + 1) % clus_secs) return;   /* Not a cluster end */
+   clus = (uint16_t)((last - data_lbn) / clus_secs) + 2;
+   if (clus > max_clus || !(next = next_cluster(clus))) return;
+
+   lbn = data_lbn + (uint32_t)(next - 2) * clus_secs;
+   n = (clus_secs < cache_slots / 2) ? clus_secs : cache_slots / 2;
+   for (; n; n--, lbn++) {
+      if (is_cached(lbn)) continue;
+      if ((i = claim_slot(lbn)) == NIL) break;
+      if ((lbn != prev + 1 && sd_read_begin(unit, lbn) != RES_OK)
+          || sd_read(unit, lbn, SLOT_PTR(i), 1) != RES_OK) {
+         drop_slot(i);
+         break;
+      }
+      prev = lbn;
+      slot_prefetched[i] = true;
+      prefetch_count++;
+   }
+}
+
+/* cache_pin */
+/*   Loads lbn..lbn+count-1 into slots that are then kept until unpinned.*/
+/* Sectors that are in the FAT/root shadow are resident anyway and are  */
+/* skipped.  Consecutive sectors are read one at a time into their own  */
+/* slots, which keeps a single CMD18 going.  Fails without pinning the  */
+/* rest once only CACHE_MIN_LRU replaceable slots would be left.        */
+int cache_pin (uint16_t unit, uint32_t lbn, uint16_t count)
+{
+   uint8_t i;
+
+   for (; count; count--, lbn++) {
+      if (shadow_index(lbn) != NO_SHADOW) continue;
+      i = find_slot(lbn);
+      if (i != NIL && slot_pinned[i]) continue;
+      if (pinned_count + CACHE_MIN_LRU >= cache_slots) return RES_ERROR;
+      if (i == NIL) {
+         if ((i = claim_slot(lbn)) == NIL) return RES_ERROR;
+         if (sd_read(unit, lbn, SLOT_PTR(i), 1) != RES_OK) {
+            drop_slot(i);
+            return RES_ERROR;
+         }
+      }
+      slot_prefetched[i] = false;
+      lru_unlink(i);
+      slot_pinned[i] = true;
+      pinned_count++;
+   }
+   return RES_OK;
+}
+
+/* cache_unpin */
+/*   Gives pinned sectors back to the LRU list as most recently used.    */
+void cache_unpin (uint32_t lbn, uint16_t count)
+{
+   uint8_t i;
+
+   for (; count; count--, lbn++) {
+      if ((i = find_slot(lbn)) == NIL || !slot_pinned[i]) continue;
+      slot_pinned[i] = false;
+      pinned_count--;
+      lru_link_head(i);
+   }
+}
+
+/* cache_preload_add */
+/*   Remembers a /R=lbn,count range.  The slots overlap the init code,   */
+/* so nothing can be read into them until deviceInit() has returned; the */
+/* ranges are loaded and pinned by the first read or write DOS sends.    */
+bool cache_preload_add (uint16_t lbn, uint16_t count)
+{
+   if (preload_n >= PRELOAD_MAX) return false;
+   preload_lbn[preload_n] = lbn;
+   preload_len[preload_n] = count;
+   preload_n++;
+   return true;
+}
+
+static
+void preload (uint16_t unit)
+{
+   uint8_t n;
+
+   for (n = 0; n < preload_n; n++)
+      cache_pin(unit, preload_lbn[n], preload_len[n]);
+   preload_n = 0;
+}
+
+/* cache_idle */
+/*   One slice of background work for the idle engine: write dirty       */
+/* sectors, lowest LBN first so that neighbours share a CMD25, for as    */
+/* long as budget (VIA ticks) allows.  A sector is only started if      */
+/* twice what the last one took is left, the second share paying for    */
+/* the close, which waits for that sector to program before it can send */
+/* STOP_TRAN.  When even the first does not fit, the estimate is decayed */
+/* so a cost measured while the card was slow does not lock the engine  */
+/* out for good.  As in cache_flush(), a run is opened with              */
+/* sd_write_begin(), and whatever the slice wrote is closed with         */
+/* sd_stop(), so no CMD25 is left open with CS low once DOS gets control */
+/* back.  The card's busy time after the close is left to the next       */
+/* command.  Returns the VIA ticks left of the budget, 0 if none.       */
+uint16_t cache_idle (uint16_t budget)
+{
+   static uint16_t unit_cost = 0;
+   uint16_t n, k, ref, t0;
+   uint32_t lbn, best, next = FREE_LBN;
+   uint8_t far *data;
+   bool first = true;
+
+   via_timer_start();
+   for (; dirty_count; first = false) {
+      t0 = via_timer_elapsed();
+      if (t0 >= budget || (budget - t0) / 2 < unit_cost) {
+         if (first) unit_cost -= unit_cost >> 3;
+         break;
+      }
+      best = FREE_LBN;
+      ref = 0;
+      for (n = 0; n < cache_slots; n++)
+         if (slot_dirty[n] && slot_lbn[n] < best) best = slot_lbn[n], ref = n;
+      for (k = 0; k < shadow_secs; k++) {
+         if (!SHADOW_DIRTY(k)) continue;
+         lbn = (k < root_secs) ? root_lbn + k : fat_lbn + (k - root_secs);
+         if (lbn < best) best = lbn, ref = SHADOW_REF | k;
+      }
+      if (best != next && is_dirty(best + 1))
+         sd_write_begin(cache_unit, best);      /* Start of a run */
+      next = best + 1;
+      data = (ref & SHADOW_REF) ? SHADOW_PTR(ref & ~SHADOW_REF) : SLOT_PTR(ref);
+      if (sd_write(cache_unit, best, data, 1) != RES_OK) break;
+      if (ref & SHADOW_REF) {
+         k = ref & ~SHADOW_REF;
+         shadow_dirty[k >> 3] &= ~(1 << (k & 7));
+      }
+      else slot_dirty[ref] = false;
+      dirty_count--;
+      unit_cost = via_timer_elapsed() - t0;
+   }
+   if (next != FREE_LBN) sd_stop(cache_unit);
+   t0 = via_timer_elapsed();
+   return (t0 < budget) ? budget - t0 : 0;
+}
+
+/* cache_read */
+/*   Hits are copied from the shadow or the slots; each run of           */
+/* consecutive misses goes to the card as one multi-block sd_read()      */
+/* straight into the DOS buffer, and is then copied into the shadow, or  */
+/* into slots if the request is small.                                   */
+int cache_read (uint16_t unit, uint32_t lbn, uint8_t far *buffer, uint16_t count)
+{
+   bool fill = (count <= CACHE_FILL_MAX);
+   uint8_t far *copy;
+   uint16_t run, n;
+   int status;
+
+   if (!cache_slots && !shadow_secs) return sd_read(unit, lbn, buffer, count);
+   if (preload_n) preload(unit);
+
+   while (count) {
+      copy = cached_copy(lbn);
+      if (copy) {
+         _fmemcpy(buffer, copy, BLOCKSIZE);
+         cache_hits++;
+         lbn++;
+         NEXT_SECTOR(buffer);
+         count--;
+         continue;
+      }
+      for (run = 1; run < count && !is_cached(lbn + run); run++) ;
+      status = sd_read(unit, lbn, buffer, run);
+      if (status != RES_OK) return status;
+      cache_misses += run;
+      for (n = run; n; n--) {
+         keep_copy(lbn, buffer, fill, false);
+         lbn++;
+         NEXT_SECTOR(buffer);
+      }
+      count -= run;
+   }
+   if (prefetch_on && cache_slots) prefetch(unit, lbn - 1);
+   return RES_OK;
+}
+
+/* cache_write */
+/*   Write-through: the card is written first, then any cached copy of   */
+/* the sectors is refreshed.  If the write fails the copies are dropped, */
+/* as there is no telling what the card now holds.                       */
+/*   In write-back mode small requests are only copied in and marked     */
+/* dirty.  Reaching dirty_limit flushes them all; a sector that cannot   */
+/* be held (its slot could not be freed) goes through to the card.       */
+int cache_write (uint16_t unit, uint32_t lbn, uint8_t far *buffer, uint16_t count)
+{
+   bool fill = (count <= CACHE_FILL_MAX);
+   int status;
+
+   if (preload_n && cache_slots) preload(unit);
+   if (dirty_limit && fill) {
+      cache_unit = unit;
+      status = RES_OK;
+      for (; count; count--, lbn++, NEXT_SECTOR(buffer)) {
+         if (keep_copy(lbn, buffer, true, true)) continue;
+         if (sd_write(unit, lbn, buffer, 1) != RES_OK) {
+            drop_copy(lbn);
+            status = RES_ERROR;
+         }
+      }
+      if (status == RES_OK && dirty_count >= dirty_limit) status = cache_flush();
+      return status;
+   }
+
+   status = sd_write(unit, lbn, buffer, count);
+   if (!cache_slots && !shadow_secs) return status;
+
+   for (; count; count--, lbn++, NEXT_SECTOR(buffer)) {
+      if (status == RES_OK) keep_copy(lbn, buffer, fill, false);
+      else drop_copy(lbn);
+   }
+   return status;
+}
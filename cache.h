@@ -0,0 +1,61 @@
+/* cache.h - sector cache between the DOS request handlers and sd.c */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "template.h"
+
+#define CACHE_MAX_SLOTS     64    /* Upper limit for /C=n (32K of buffers) */
+#define CACHE_DEFAULT_SLOTS 0     /* Off, the driver stays small; /C=16 is 8K */
+
+#define PRELOAD_MAX         4     /* /R=lbn,count ranges on the DEVICE= line */
+
+#define SHADOW_MAX_SECTORS     320   /* Upper limit for /F=n: 256 FAT + 64 root */
+#define SHADOW_DEFAULT_SECTORS 0     /* Off; /F=64 holds 32K of FAT #1 + root */
+
+extern uint16_t cache_slots;      /* /C=n: number of 512 byte slots, 0 = off */
+extern uint32_t cache_hits;       /* Sectors served from the cache */
+extern uint32_t cache_misses;     /* Sectors that had to come from the card */
+extern uint16_t dirty_limit;      /* /L=n: write-back, flush at n dirty sectors, 0 = off */
+extern bool prefetch_on;          /* /A: follow the FAT chain and read ahead */
+extern uint32_t prefetch_count;   /* Sectors read ahead */
+extern uint32_t prefetch_hits;    /* ... that DOS then asked for */
+extern uint32_t prefetch_wasted;  /* ... that were evicted unused */
+extern uint16_t pinned_count;     /* Slots pinned by /R or IOCTL */
+extern uint16_t shadow_max;       /* /F=n: FAT/root shadow sectors, 0 = off */
+
+/* cache_init - place the slots at endaddr, return the new end of the driver */
+void far *cache_init (void far *endaddr);
+
+/* shadow_init - place the FAT/root shadow at endaddr, return the new end */
+void far *shadow_init (void far *endaddr, bpb far *bpb);
+
+/* cache_invalidate - forget everything held in the cache */
+void cache_invalidate (void);
+
+/* cache_read - sd_read() that serves what it can from the cache */
+int cache_read (uint16_t unit, uint32_t lbn, uint8_t far *buffer, uint16_t count);
+
+/* cache_write - sd_write() that keeps cached copies current or holds them dirty */
+int cache_write (uint16_t unit, uint32_t lbn, uint8_t far *buffer, uint16_t count);
+
+/* cache_flush - write all dirty sectors to the card, sorted by LBN */
+int cache_flush (void);
+
+/* cache_pin - load a range of sectors into the cache and keep it there */
+int cache_pin (uint16_t unit, uint32_t lbn, uint16_t count);
+
+/* cache_unpin - let a pinned range be replaced again */
+void cache_unpin (uint32_t lbn, uint16_t count);
+
+/* cache_preload_add - queue a /R range to be pinned on the first request */
+bool cache_preload_add (uint16_t lbn, uint16_t count);
+
+/* cache_idle - write back dirty sectors for at most budget VIA ticks, */
+/* returns the ticks left                                               */
+uint16_t cache_idle (uint16_t budget);
+
+#endif
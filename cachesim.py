@@ -0,0 +1,276 @@
+import os
+import sys
+from collections import OrderedDict
+
+import readlog
+
+# Replays a trace of INPUT/OUTPUT requests through models of a sector
+# cache and prints the read hit rate each reaches for a range of memory
+# sizes, to pick /C=n, /F=n and /R settings from real access patterns.
+#
+#   cachesim.py [-s slots,...] [-f n] [-m image] trace...
+#
+# A trace is either a card image holding a /T trace (the "access read:"
+# and "access write:" records of readBlock() and write_block()), the
+# text readlog.py prints from one, or a sim/workloads file.  The models:
+#
+#   LRU     what cache.c does with /C=n: one LRU list of 512 byte slots
+#   2Q      a FIFO for sectors seen once, promoting to an LRU list only
+#           sectors that come back after leaving it (Johnson and Shasha)
+#   pinned  half the memory holds the root directory and then FAT #1,
+#           like the /F shadow, and the other half is LRU
+#
+# Like cache.c, a miss only fills a slot when the request is no more than
+# -f sectors (CACHE_FILL_MAX, 2) and writes update the sectors they hit;
+# -f 0 fills on every miss.  The pinned model needs the volume layout,
+# which comes from the image (or -m image when the trace is text).
+
+SECTOR_SIZE = readlog.SECTOR_SIZE
+FILL_MAX = 2
+DEFAULT_SLOTS = [4, 8, 16, 32, 64, 128, 256, 512]
+FAT_TYPES = (0x01, 0x04, 0x06, 0x0E)
+
+
+def is_card_image(filename):
+    with open(filename, 'rb') as f:
+        return f.read(SECTOR_SIZE)[510:512] == b'\x55\xAA'
+
+
+def image_trace(filename):
+    # (write, lbn, count, tick) from the access records on the card
+    here = os.path.dirname(os.path.abspath(__file__))
+    sites = readlog.read_sites(os.path.join(here, 'logsites.h'))
+    trace = []
+    for seq, slot, dropped, data in readlog.read_log_sectors(filename):
+        pos = 0
+        while pos < len(data):
+            name, args, pos = readlog.parse_record(sites, data, pos)
+            if name is None:
+                break
+            if name in ('LS_ACCESS_READ', 'LS_ACCESS_WRITE'):
+                trace.append((name == 'LS_ACCESS_WRITE', args[1], args[2] & 0xFFFF, args[3]))
+    return trace
+
+
+def field(words, key):
+    return int(words[words.index(key) + 1], 0)
+
+
+def text_trace(filename):
+    # readlog.py output or a workload file.  If the text has access
+    # records, the read:/write: debug records of the same requests are
+    # left out so they do not count twice.
+    access, other = [], []
+    with open(filename) as f:
+        for line in f:
+            words = line.split('#')[0].split()
+            if not words:
+                continue
+            try:
+                if words[0] == 'access' and words[1] in ('read:', 'write:'):
+                    access.append((words[1] == 'write:', field(words, 'start'),
+                                   field(words, 'count'), field(words, 'tick')))
+                elif words[0] in ('read:', 'write:'):
+                    other.append((words[0] == 'write:', field(words, 'start'),
+                                  field(words, 'count'), 0))
+                elif words[0] in ('read', 'write', 'verify') and len(words) >= 3:
+                    lbn, count = int(words[1], 0), int(words[2], 0)
+                    repeat = int(words[3], 0) if len(words) > 3 else 1
+                    step = int(words[4], 0) if len(words) > 4 else count
+                    for i in range(repeat):
+                        other.append((words[0] != 'read', lbn + i * step, count, 0))
+            except (ValueError, IndexError):
+                print(f"{filename}: \"{line.strip()}\" not understood")
+    return access or other
+
+
+def volume_metadata(filename):
+    # Partition relative sectors of the root directory and FAT #1, in the
+    # order the driver's shadow takes them, or None
+    with open(filename, 'rb') as f:
+        mbr = f.read(SECTOR_SIZE)
+        start = 0
+        if mbr[510:512] == b'\x55\xAA' and mbr[0] not in (0xEB, 0xE9):
+            for entry in range(4):
+                e = mbr[0x1BE + 16 * entry:0x1BE + 16 * entry + 16]
+                if e[4] in FAT_TYPES:
+                    start = int.from_bytes(e[8:12], 'little')
+                    break
+            else:
+                return None
+        f.seek(start * SECTOR_SIZE)
+        boot = f.read(SECTOR_SIZE)
+    if len(boot) < SECTOR_SIZE or int.from_bytes(boot[11:13], 'little') != SECTOR_SIZE:
+        return None
+    reserved = int.from_bytes(boot[14:16], 'little')
+    fats = boot[16]
+    root_secs = (int.from_bytes(boot[17:19], 'little') * 32 + SECTOR_SIZE - 1) // SECTOR_SIZE
+    fat_secs = int.from_bytes(boot[22:24], 'little')
+    root = reserved + fats * fat_secs
+    return list(range(root, root + root_secs)) + list(range(reserved, reserved + fat_secs))
+
+
+class LRU:
+    def __init__(self, slots):
+        self.slots = slots
+        self.lru = OrderedDict()
+
+    def read(self, lbn, fill):
+        if lbn in self.lru:
+            self.lru.move_to_end(lbn)
+            return True
+        if fill:
+            self.insert(lbn)
+        return False
+
+    def write(self, lbn, fill):
+        if lbn in self.lru:
+            self.lru.move_to_end(lbn)
+        elif fill:
+            self.insert(lbn)
+
+    def insert(self, lbn):
+        if self.slots <= 0:
+            return
+        if len(self.lru) >= self.slots:
+            self.lru.popitem(last=False)
+        self.lru[lbn] = True
+
+
+class TwoQ:
+    def __init__(self, slots):
+        self.slots = slots
+        self.kin = max(1, slots // 4)
+        self.kout = max(1, slots // 2)
+        self.a1in = OrderedDict()      # Seen once, FIFO
+        self.a1out = OrderedDict()     # Ghosts of what left a1in, no data
+        self.am = OrderedDict()        # Seen again, LRU
+
+    def read(self, lbn, fill):
+        if lbn in self.am:
+            self.am.move_to_end(lbn)
+            return True
+        if lbn in self.a1in:
+            return True
+        if fill:
+            self.insert(lbn)
+        return False
+
+    def write(self, lbn, fill):
+        if lbn in self.am:
+            self.am.move_to_end(lbn)
+        elif lbn not in self.a1in and fill:
+            self.insert(lbn)
+
+    def insert(self, lbn):
+        if self.slots <= 0:
+            return
+        if len(self.a1in) + len(self.am) >= self.slots:
+            if len(self.a1in) > self.kin or not self.am:
+                old, _ = self.a1in.popitem(last=False)
+                self.a1out[old] = True
+                if len(self.a1out) > self.kout:
+                    self.a1out.popitem(last=False)
+            else:
+                self.am.popitem(last=False)
+        if lbn in self.a1out:
+            del self.a1out[lbn]
+            self.am[lbn] = True
+        else:
+            self.a1in[lbn] = True
+
+
+class Pinned:
+    def __init__(self, slots, metadata):
+        pinned = min(len(metadata), slots // 2)
+        self.pinned = set(metadata[:pinned])
+        self.loaded = set()
+        self.lru = LRU(slots - pinned)
+
+    def read(self, lbn, fill):
+        if lbn in self.pinned:
+            hit = lbn in self.loaded
+            self.loaded.add(lbn)
+            return hit
+        return self.lru.read(lbn, fill)
+
+    def write(self, lbn, fill):
+        if lbn in self.pinned:
+            self.loaded.add(lbn)
+        else:
+            self.lru.write(lbn, fill)
+
+
+def replay(trace, model, fill_max):
+    hits = 0
+    for write, lbn, count, tick in trace:
+        fill = fill_max == 0 or count <= fill_max
+        for sector in range(lbn, lbn + count):
+            if write:
+                model.write(sector, fill)
+            elif model.read(sector, fill):
+                hits += 1
+    return hits
+
+
+def summary(trace):
+    reads = [t for t in trace if not t[0]]
+    read_sectors = sum(t[2] for t in reads)
+    written = sum(t[2] for t in trace if t[0])
+    distinct = set()
+    for write, lbn, count, tick in reads:
+        distinct.update(range(lbn, lbn + count))
+    ticks = trace[-1][3] - trace[0][3] if trace else 0
+    print(f"{len(trace)} requests ({len(reads)} reads, {len(trace) - len(reads)} writes), "
+          f"{read_sectors} sectors read, {written} written, {ticks} ticks")
+    if read_sectors:
+        print(f"{len(distinct)} distinct sectors read, no cache can hit more than "
+              f"{100.0 * (read_sectors - len(distinct)) / read_sectors:.1f}%")
+    return read_sectors
+
+
+def simulate(trace, slots, fill_max, metadata):
+    read_sectors = summary(trace)
+    if not read_sectors:
+        return
+    if metadata:
+        print(f"pinned: root directory and FAT #1, {len(metadata)} sectors")
+    print(f"{'memory':>8} {'slots':>6} {'LRU':>7} {'2Q':>7} {'pinned':>7}")
+    for n in slots:
+        rates = [replay(trace, LRU(n), fill_max), replay(trace, TwoQ(n), fill_max)]
+        if metadata:
+            rates.append(replay(trace, Pinned(n, metadata), fill_max))
+        cells = ' '.join(f"{100.0 * hits / read_sectors:6.1f}%" for hits in rates)
+        print(f"{n * SECTOR_SIZE // 1024:>7}K {n:>6} {cells}")
+
+
+def main(argv):
+    slots, fill_max, meta_image, files = DEFAULT_SLOTS, FILL_MAX, None, []
+    args = iter(argv)
+    for arg in args:
+        if arg == '-s':
+            slots = [int(n) for n in next(args).split(',')]
+        elif arg == '-f':
+            fill_max = int(next(args))
+        elif arg == '-m':
+            meta_image = next(args)
+        else:
+            files.append(arg)
+    if not files:
+        print("Usage: cachesim.py [-s slots,...] [-f fill max] [-m image] trace...")
+        return 2
+
+    for filename in files:
+        print(f"{filename}:")
+        if is_card_image(filename):
+            trace = image_trace(filename)
+            metadata = volume_metadata(meta_image or filename)
+        else:
+            trace = text_trace(filename)
+            metadata = volume_metadata(meta_image) if meta_image else None
+        simulate(trace, slots, fill_max, metadata)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -34,38 +34,192 @@
 #include <string.h>
 
 #include "cprint.h"     /* Console printing */
-
-#define LOG_SECTOR_START 15 // Start log file at the 16th sector
-#define SECTOR_SIZE 512
-#define NUM_SECTORS 32
-#define BUFFER_SIZE ((NUM_SECTORS - LOG_SECTOR_START) * SECTOR_SIZE)
-
-static size_t head = 0;  
-static size_t tail = BUFFER_SIZE - 1; // Points to the end of the logBuffer
-char logBuffer[SECTOR_SIZE] = {0};
+#include "diskio.h"
+
+/* Trace ring.  logRecord() appends to a RAM ring of LogSectors          */
+/* (see cprint.h) and flushDriveLog() copies whole sectors of it into the */
+/* reserved card sectors LOG_SECTOR_START.. in front of the partition.  */
+/* The card slot of a sector is its sequence number mod LOG_CARD_SECTORS, */
+/* so the card holds the newest LOG_CARD_SECTORS sectors in a ring too.  */
+/* Appending runs with interrupts off; flushing does not, so a sector   */
+/* overwritten by an appender while it is on its way to the card can    */
+/* reach the card torn.  The decoder tolerates that.                    */
+uint8_t log_level = 0;                        /* /T=n: record sites up to level n */
+static LogSector logBuffer[LOG_RAM_SECTORS];  /* The RAM ring */
+static uint8_t log_fill = 0;       /* Sector being appended to */
+static uint8_t log_flush = 0;      /* Oldest full sector not yet on the card */
+static uint32_t log_seq = 0;       /* Sequence number of the next sector */
+static uint16_t log_dropped = 0;   /* Bytes lost to overruns since the last sector */
+static uint16_t log_written = 0;   /* ls_used of log_fill when it last went to the card */
+static bool log_synced = false;    /* log_seq continues the card's numbering */
+static bool log_failed = false;    /* A card write failed, stop trying */
+static uint16_t log_cost = 0;      /* VIA ticks per sector, last budgeted flush */
 extern bool debug;
+extern bool initNeeded;
+
+#ifdef SDSIM
+/* The host build (sim/) has no interrupts to hold off */
+#define save_flags_cli()    0
+#define restore_flags(f)    ((void)(f))
+#else
+static uint16_t save_flags_cli (void);
+#pragma aux save_flags_cli = \
+    "pushf" \
+    "pop ax" \
+    "cli" \
+    value [ax];
+
+static void restore_flags (uint16_t flags);
+#pragma aux restore_flags = \
+    "push ax" \
+    "popf" \
+    parm [ax];
+#endif
+
+/* startLogSector - open logBuffer[i] as the next sector of the trace */
+static void startLogSector (uint8_t i)
+{
+    LogSector *ls = &logBuffer[i];
+
+    memcpy(ls->ls_magic, LOG_MAGIC, sizeof(ls->ls_magic));
+    ls->ls_seq = log_seq++;
+    ls->ls_used = 0;
+    ls->ls_dropped = log_dropped;
+    log_dropped = 0;
+}
 
-void writeBuffer(char *data) {  
-   
-    int i = 0;
-    while(data[i] != '\0') {
-        logBuffer[head] = data[i];
-        head = (head + 1) % BUFFER_SIZE;
-        if (head == tail) {
-            head = 0; // Overwrite old data
+/* logRecord - add a record to the trace ring, starting a new sector if */
+/* it does not fit and dropping the oldest unflushed sector if the ring  */
+/* is full.  Called through the LOGn() macros only.                      */
+void logRecord (uint8_t site, uint8_t nargs, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    uint32_t args[LOG_MAX_ARGS];
+    uint16_t len = 1 + nargs * sizeof(uint32_t);
+    uint16_t flags;
+    LogSector *ls;
+    uint8_t next;
+
+    args[0] = a;  args[1] = b;  args[2] = c;  args[3] = d;
+
+    flags = save_flags_cli();
+    if (log_seq == 0) startLogSector(0);
+    ls = &logBuffer[log_fill];
+    if (ls->ls_used + len > LOG_DATA_SIZE) {
+        next = (log_fill + 1) % LOG_RAM_SECTORS;
+        if (next == log_flush) {
+            log_dropped += logBuffer[next].ls_used;
+            log_flush = (next + 1) % LOG_RAM_SECTORS;
         }
-        i++;
+        log_fill = next;
+        log_written = 0;
+        startLogSector(next);
+        ls = &logBuffer[next];
     }
+    ls->ls_data[ls->ls_used] = site;
+    memcpy(ls->ls_data + ls->ls_used + 1, args, len - 1);
+    ls->ls_used += len;
+    restore_flags(flags);
 }
 
-void readBuffer(char *output, int maxSize) {
-    int i = 0;
-    while (tail != head && i < maxSize - 1) {
-        output[i] = logBuffer[tail];
-        tail = (tail + 1) % BUFFER_SIZE;
-        i++;
+/* syncDriveLog - continue the numbering of the sectors already on the  */
+/* card, so the decoder can tell this boot's trace from older ones.      */
+/* It reads all LOG_CARD_SECTORS, so it is called once, at init, and    */
+/* flushDriveLog() writes nothing until it has succeeded.               */
+bool syncDriveLog (void)
+{
+    LogSector ls;
+    uint32_t base = 0;
+    uint16_t flags;
+    uint8_t i;
+
+    for (i = 0; i < LOG_CARD_SECTORS; ++i) {
+        if (disk_read(0, (uint8_t far *)&ls, LOG_SECTOR_START + i, 1) != RES_OK)
+            return false;
+        if (!memcmp(ls.ls_magic, LOG_MAGIC, sizeof(ls.ls_magic)) && ls.ls_seq >= base)
+            base = ls.ls_seq + 1;
     }
-    output[i] = '\0';
+
+    flags = save_flags_cli();
+    if (log_seq == 0) startLogSector(0);   /* Else logRecord() would not */
+    for (i = 0; i < LOG_RAM_SECTORS; ++i)
+        logBuffer[i].ls_seq += base;
+    log_seq += base;
+    log_synced = true;
+    restore_flags(flags);
+    return true;
+}
+
+/* logFit - how many of run sectors may still go to the card within    */
+/* budget VIA ticks of the via_timer_start() in flushDriveLog(), keeping */
+/* half of what is left for the close.  When not even the first fits,   */
+/* the estimate is decayed, as in cache_idle().                         */
+static uint8_t logFit (uint16_t budget, uint8_t run, bool first)
+{
+    uint16_t t = via_timer_elapsed();
+    uint16_t left = (t < budget) ? (budget - t) / 2 : 0;
+
+    if (!left) run = 0;
+    else if (log_cost && left / log_cost < run) run = (uint8_t)(left / log_cost);
+    if (!run && first) log_cost -= log_cost >> 3;
+    return run;
+}
+
+/* flushDriveLog - copy the trace ring to the card.  Full sectors go    */
+/* out in multi-block runs once LOG_FLUSH_SECTORS of them are waiting,  */
+/* or whenever all is set, which also rewrites the partly filled sector */
+/* if it has grown.  Only called between requests: from the idle       */
+/* engine and at the end of a request that left no CMD18/CMD25 open,    */
+/* since writing the trace tears a stream down.  budget 0 writes all    */
+/* that is due and waits for the card to program it.  Otherwise only as */
+/* many sectors as fit in budget VIA ticks go, and the card's busy time */
+/* is left to the next command, as the idle engine must not wait.       */
+void flushDriveLog (bool all, uint16_t budget)
+{
+    uint8_t i, run, pending;
+    uint16_t slot, flags, t0 = 0;
+    bool first = true;
+
+    if (!log_level || log_failed || !log_synced || initNeeded || log_seq == 0)
+        return;
+    pending = (log_fill + LOG_RAM_SECTORS - log_flush) % LOG_RAM_SECTORS;
+    if (!all && pending < LOG_FLUSH_SECTORS)
+        return;
+    if (budget) via_timer_start();
+
+    for (; pending; first = false) {
+        i = log_flush;
+        slot = (uint16_t)(logBuffer[i].ls_seq % LOG_CARD_SECTORS);
+        run = pending;
+        if (run > LOG_RAM_SECTORS - i) run = LOG_RAM_SECTORS - i;
+        if (run > LOG_CARD_SECTORS - slot) run = LOG_CARD_SECTORS - slot;
+        if (budget) {
+            if (!(run = logFit(budget, run, first))) break;
+            t0 = via_timer_elapsed();
+        }
+        if (disk_write(0, (const uint8_t far *)&logBuffer[i], LOG_SECTOR_START + slot, run) != RES_OK) {
+            log_failed = true;
+            return;
+        }
+        if (budget) log_cost = (via_timer_elapsed() - t0) / run;
+        flags = save_flags_cli();
+        if (log_flush == i)   /* else an appender dropped it meanwhile */
+            log_flush = (i + run) % LOG_RAM_SECTORS;
+        pending = (log_fill + LOG_RAM_SECTORS - log_flush) % LOG_RAM_SECTORS;
+        restore_flags(flags);
+    }
+
+    if (all && !pending && logBuffer[log_fill].ls_used != log_written
+        && (!budget || logFit(budget, 1, first))) {
+        i = log_fill;
+        log_written = logBuffer[i].ls_used;
+        slot = (uint16_t)(logBuffer[i].ls_seq % LOG_CARD_SECTORS);
+        if (disk_write(0, (const uint8_t far *)&logBuffer[i], LOG_SECTOR_START + slot, 1) != RES_OK) {
+            log_failed = true;
+            return;
+        }
+    }
+    if (budget) disk_stop(0);
+    else disk_flush(0);
 }
 
 char* intToAscii(int32_t value, char *buffer, size_t bufferSize) {
@@ -105,155 +259,6 @@ uint32_t calculateLinearAddress(uint16_t segment, uint16_t offset) {
 }
 
 
-void writeToDriveLog(const char* format, ...) {
-    char buffer[SECTOR_SIZE];  // Temporary buffer for formatted string
-    char *bufferPtr = buffer;
-    uint16_t remainingSize = SECTOR_SIZE;  // Remaining space in the buffer
-    static uint8_t logNum = 0;  // Log number
-    logNum++;
-
-    //insert some spacers just to help readability of log
-    uint8_t delimeter = 2;
-    for (uint8_t i =0; i<delimeter; i++) {
-        *bufferPtr++ = ' '; 
-        remainingSize--;    
-    }
-    
-    char logNumStr[12];  // Enough for 32-bit int, sign, and null terminator
-    char *logStr = intToAscii(logNum, (char *)logNumStr, sizeof(logNumStr));
-    while (*logStr && remainingSize > 0) {
-        *bufferPtr++ = *logStr++;
-        remainingSize--;
-    }
-    *bufferPtr++ = '|';
-    remainingSize--;
-    
-    va_list args;
-    va_start(args, format);
-
-    const char *p = format;
-    while (*p && remainingSize > 0) {
-        if (*p == '%') {
-            int size = 4;
-            char nextChar = *(p + 1);
-            if ((nextChar >= '0')  &&  (nextChar <= '9')) {
-                size = nextChar - '0';  
-                remainingSize--;
-                p++;
-            }
-            switch (*++p) {
-                case 'd': {
-                    int16_t num = va_arg(args, int16_t);
-                    char numStr[12];  // Enough for 32-bit int, sign, and null terminator
-                    char *str = intToAscii(num, (char *)numStr, sizeof(numStr));
-                    while (*str && remainingSize > 0) {
-                        *bufferPtr++ = *str++;
-                        remainingSize--;
-                    }
-                    break;
-                }
-                case 's': {
-                    char *str = va_arg(args, char*);
-                    while (*str && remainingSize > 0) {
-                        *bufferPtr++ = *str++;
-                        remainingSize--;
-                    }
-                    break;
-                }
-                case 'x': { // handle 16-bit hex number
-                    uint16_t val = (uint16_t)va_arg(args, int); // Promoted to int, then cast to 16-bit
-                    for (int i = size - 1; i >= 0; i--) {
-                        uint8_t digit = (val >> (4 * i)) & 0xF;
-                        if (digit > 9) *bufferPtr++ = 'A' + digit - 10;
-                        else *bufferPtr++ = '0' + digit;
-                    }
-                    break;
-                }
-                case 'X': { // handle 32-bit hex number
-                    if (size == 4) {
-                        size = 8;
-                    }
-                    uint32_t val = (uint32_t)va_arg(args, uint32_t);
-                    for (int i = size - 1; i >= 0; i--) {
-                        uint8_t digit = (val >> (4 * i)) & 0xF;
-                        if (digit > 9) *bufferPtr++ = 'A' + digit - 10;
-                        else *bufferPtr++ = '0' + digit;
-                    }
-                    break;
-                }
-                case 'p': {
-                    // Retrieve the pointer once and extract segment and offset
-                    void far *ptr = va_arg(args, void*);
-                    uint16_t seg = FP_SEG(ptr);
-                    uint16_t off = FP_OFF(ptr);
-
-                    // Calculate linear address (segment*16 + offset)
-                    uint32_t linearAddr = ((uint32_t)seg << 4) + off;
-
-                    // Convert segment to hexadecimal
-                    for (int32_t i = (sizeof(uint16_t) * 2) - 1; i >= 0; i--) {
-                        uint16_t digit = (seg >> (4 * i)) & 0xF;
-                        *bufferPtr++ = digit > 9 ? 'A' + digit - 10 : '0' + digit;
-                    }
-                    *bufferPtr++ = ':';
-
-                    // Convert offset to hexadecimal
-                    for (int32_t i = (sizeof(uint16_t) * 2) - 1; i >= 0; i--) {
-                        uint16_t digit = (off >> (4 * i)) & 0xF;
-                        *bufferPtr++ = digit > 9 ? 'A' + digit - 10 : '0' + digit;
-                    }
-
-                    // Add space for readability
-                    *bufferPtr++ = ' ';
-                    *bufferPtr++ = '=';
-
-                    // Convert linear address to hexadecimal
-                    for (int32_t i = (sizeof(uint32_t) * 2) - 1; i >= 0; i--) {
-                        uint32_t digit = (linearAddr >> (4 * i)) & 0xF;
-                        *bufferPtr++ = digit > 9 ? 'A' + digit - 10 : '0' + digit;
-                    }
-                    break;
-                }
-                case 'L': {  // Custom specifier for int32_t
-                    int32_t longNum = va_arg(args, int32_t);
-                    char longNumStr[12];  // Enough for 32-bit int, sign, and null terminator
-                    char *str = intToAscii(longNum, longNumStr, sizeof(longNumStr));
-                    while (*str && remainingSize > 0) {
-                        *bufferPtr++ = *str++;
-                        remainingSize--;
-                    }
-                    break;
-                }
-                // Add other format specifiers as needed
-                default:
-                    if (remainingSize > 1) {
-                        *bufferPtr++ = '%';
-                        *bufferPtr++ = *p;
-                        remainingSize -= 2;
-                    }
-                    break;
-            }
-        } else {
-            *bufferPtr++ = *p;
-            remainingSize--;
-        }
-        p++;
-    }
-
-    *bufferPtr = '\0'; // Null-terminate the buffer
-    va_end(args);
-
-    size_t messageLen = bufferPtr - buffer;
-
-
-    // Write the formatted message to the current position
-    if (debug) {
-        //writeBuffer(buffer);
-        cdprintf(buffer);
-    }
-    
-}
-
 void set_crtc_reg(char reg, char value) {
     static volatile char far *crtc_addr_reg = MK_FP(PHASE2_DEVICE_SEGMENT, 
                                                    CRTC_ADDR_REG_OFFSET);
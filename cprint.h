@@ -49,6 +49,70 @@
 #define SCREEN_MASK 0x999   //Screen wrap around mask
 #define FONT_GLYFF_SEGMENT 0xC00
 #define FONT_GLYFF_OFFSET 0x0000
+
+/* Trace ring, see cprint.c.  Sectors LOG_SECTOR_START..+LOG_CARD_SECTORS */
+/* of the card lie in front of the partition and hold the newest sectors */
+/* of the trace; readlog.py decodes them from a card image.              */
+#define LOG_SECTOR_START  15     /* Start log at the 16th sector of the card */
+#define LOG_CARD_SECTORS  17     /* ... up to sector 31 */
+#define LOG_RAM_SECTORS   4      /* Sectors of trace held in memory */
+#define LOG_FLUSH_SECTORS 2      /* Full sectors that trigger a flush */
+#define LOG_MAGIC         "SDTR"
+#define LOG_DATA_SIZE     500
+
+#pragma pack(1)
+typedef struct {
+  char ls_magic[4];              /* LOG_MAGIC */
+  uint32_t ls_seq;               /* Increases by one per sector, across boots */
+  uint16_t ls_used;              /* Bytes of ls_data in use */
+  uint16_t ls_dropped;           /* Bytes lost to overruns before this sector */
+  uint8_t ls_data[LOG_DATA_SIZE];  /* Whole records, see below */
+} LogSector;
+#pragma pack()
+
+/* Trace records.  A record is the site number (one byte) followed by    */
+/* its arguments as 32 bit little endian words; the site's format in     */
+/* logsites.h says how many.  Records never straddle a sector.  A site  */
+/* only records when log_level (/T=n) is at least the site's level, and */
+/* when it is not, all it costs is that one compare.                     */
+#define LOG_ERR           1
+#define LOG_INFO          2
+#define LOG_DEBUG         3
+#define LOG_MAX_ARGS      4
+
+enum {
+  LS_NONE,
+#define LOG_SITE(id, level, format) id,
+#include "logsites.h"
+#undef LOG_SITE
+  LS_COUNT
+};
+
+enum {
+#define LOG_SITE(id, level, format) id##_LEVEL = level,
+#include "logsites.h"
+#undef LOG_SITE
+  LS_NONE_LEVEL = 0
+};
+
+extern uint8_t log_level;
+void logRecord(uint8_t site, uint8_t nargs, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+bool syncDriveLog(void);
+void flushDriveLog(bool all, uint16_t budget);
+
+#define LOG0(id) \
+  do { if (log_level >= id##_LEVEL) logRecord(id, 0, 0, 0, 0, 0); } while (0)
+#define LOG1(id, a) \
+  do { if (log_level >= id##_LEVEL) logRecord(id, 1, (uint32_t)(a), 0, 0, 0); } while (0)
+#define LOG2(id, a, b) \
+  do { if (log_level >= id##_LEVEL) \
+    logRecord(id, 2, (uint32_t)(a), (uint32_t)(b), 0, 0); } while (0)
+#define LOG3(id, a, b, c) \
+  do { if (log_level >= id##_LEVEL) \
+    logRecord(id, 3, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), 0); } while (0)
+#define LOG4(id, a, b, c, d) \
+  do { if (log_level >= id##_LEVEL) \
+    logRecord(id, 4, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)); } while (0)
 void set_crtc_reg(char reg, char value);
 char get_crtc_reg(char reg);
 void set_screen_start(uint16_t start_addr);
@@ -63,7 +127,6 @@ void outhex (unsigned val, int ndigits);
 void outcrlf (void);
 char* intToAscii(int32_t value, char *buffer, size_t bufferSize);
 uint32_t calculateLinearAddress(uint16_t segment, uint16_t offset);
-void writeToDriveLog(const char* format, ...);
 void strreverse(char* begin, char* end);
 void cdprintf (char *msg, ...);
 #endif
@@ -125,6 +125,13 @@
  */
 #define GET_DISK_DRIVE_PHYSICAL_INFO 0x10
 
+/*
+ * IOCTL Commands specific to this driver (GET_CACHE_STATS and the
+ * counters are in stats.h, which SDSTAT shares)
+ */
+#define PIN_SECTORS     0x81     /* IOCTL output */
+#define UNPIN_SECTORS   0x82     /* IOCTL output */
+
 /*
  *      Convienence macros
  */
@@ -387,9 +394,21 @@ typedef struct {
   uint8_t di_disk_location;   /* for floppy only 0 = left, 1 = right drive */
 } V9kDiskInfo;
 
+/* SD driver IOCTL Pin_Sectors() / Unpin_Sectors() data structure */
+typedef struct {
+  uint8_t pr_ioctl_type;     /* PIN_SECTORS or UNPIN_SECTORS */
+  uint8_t pr_ioctl_status;   /* 0 if successful, 1 if error */
+  uint32_t pr_lbn;           /* First sector, relative to the partition */
+  uint16_t pr_count;         /* Number of sectors */
+} SdPinRequest;
+
 typedef boot super;             /* Alias for boot structure             */
 
+#ifdef SDSIM
+typedef bpb *bpbtbl_t[1];         /* gcc needs a complete element type */
+#else
 typedef bpb *near bpbtbl_t[];     /*  Array of BPBs     */
+#endif
 
 typedef struct {
   uint8_t r_length;               /*  Request Header length               */
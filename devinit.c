@@ -56,6 +56,7 @@
 #include "cprint.h"     /* Console printing direct to hardware */
 #include "sd.h"         /* SD card glue */
 #include "diskio.h"     /* SD card library header */
+#include "cache.h"      /* Sector cache */
 
 #pragma data_seg("_CODE")
 bool debug = FALSE;
@@ -154,6 +155,46 @@ uint16_t deviceInit( void )
         //fpRequest->r_endaddr = MK_FP( getCS(), 0 );
         return (S_DONE | S_ERROR | E_NOT_READY ); 
     }
+    if (spi_backend == SPI_CA2)     /* One CA2 pulse per write, no delay used */
+        cdprintf("SD: SCLK pulsed from CA2 (SPI mode 3)\n");
+    else
+        cdprintf("SD: SPI bit delay %d%s\n", bit_delay_us, bit_delay_fixed ? " (fixed)" : "");
+
+    /* The sector cache and the FAT/root shadow take the memory past transient_data */
+    fpRequest->r_endaddr = cache_init(fpRequest->r_endaddr);
+    fpRequest->r_endaddr = shadow_init(fpRequest->r_endaddr, my_bpb_ptr);
+    cdprintf("SD: sector cache %d slots, FAT/root shadow %d sectors\n", cache_slots, shadow_max);
+    if (dirty_limit) {
+        /* Save the old reboot vector and install ours, so a reboot flushes the cache */
+        old_int19 = _dos_getvect(0x19);
+        _dos_setvect(0x19, rebootHandler);
+        cdprintf("SD: write-back cache, flush at %d dirty sectors\n", dirty_limit);
+    }
+    if (prefetch_on) cdprintf("SD: FAT chain prefetch on\n");
+    if (log_level) {
+        /* The trace sectors must not belong to the partition */
+        if (partition_offset < LOG_SECTOR_START + LOG_CARD_SECTORS) {
+            cdprintf("SD: no room for the trace before the partition, /T ignored\n");
+            log_level = 0;
+        } else if (!syncDriveLog()) {
+            /* Reading the old trace sectors is too slow for the idle engine */
+            cdprintf("SD: cannot read the trace sectors, /T ignored\n");
+            log_level = 0;
+        } else {
+            cdprintf("SD: trace level %d in sectors %d-%d\n", log_level, LOG_SECTOR_START,
+                LOG_SECTOR_START + LOG_CARD_SECTORS - 1);
+        }
+    }
+    if (idle_budget && (dirty_limit || log_level)) {
+        /* Background write-back and trace flushing while DOS is idle and */
+        /* on the timer tick                                                */
+        old_int28 = _dos_getvect(0x28);
+        _dos_setvect(0x28, idleHandler);
+        old_int1c = _dos_getvect(0x1C);
+        _dos_setvect(0x1C, tickHandler);
+        cdprintf("SD: idle work, %d ms slices\n", idle_budget / VIA_TICKS_PER_MS);
+    }
+
     //setting unit count to 1 to make DOS happy
     dev_header->dh_num_drives = 1;
     fpRequest->r_nunits = 1;         //tell DOS how many drives we're instantiating.
@@ -174,7 +215,7 @@ uint16_t deviceInit( void )
 
     if (debug) {
         cdprintf("SD: my_bpb_ptr = %4x:%4x  %5X\n", FP_SEG(my_bpb_ptr), FP_OFF(my_bpb_ptr), bpb_start);
-        writeToDriveLog("SD: my_bpb_ptr = %4x:%4x  %5X\n", FP_SEG(my_bpb_ptr), FP_OFF(my_bpb_ptr), bpb_start);
+        LOG1(LS_INIT_BPB, (bpb far *)my_bpb_ptr);
         cdprintf("SD: initialized on DOS drive %c r_firstunit: %d r_nunits: %d\n",(
             fpRequest->r_firstunit + 'A'), fpRequest->r_firstunit, fpRequest->r_nunits);
     
@@ -236,6 +277,18 @@ char far *option_value (char far *p, uint16_t far *v)
   return null ? FALSE : p;
 }
 
+/* option_range */
+/*   Same as option_value, for a pair of numbers in the form "=nnn,nnn". */
+char far *option_range (char far *p, uint16_t far *v1, uint16_t far *v2)
+{
+  bool null = TRUE;
+  if ((p = option_value(p, v1)) == FALSE)  return FALSE;
+  if (*p++ != ',')  return FALSE;
+  for (*v2=0;  *p>='0' && *p<='9';  ++p)
+    *v2 = (*v2 * 10) + (*p - '0'),  null = FALSE;
+  return null ? FALSE : p;
+}
+
 /* parse_options */
 /*   This routine will parse our line from CONFIG.SYS and extract the   */
 /* driver options from it.  The routine returns TRUE if it parsed the   */
@@ -244,9 +297,25 @@ char far *option_value (char far *p, uint16_t far *v)
 /* acter after "DEVICE=", so we have to first skip over our own file */
 /* name by searching for a blank.  All the option values are stored in  */
 /* global variables (e.g. DrivePort, DriveBaud, etc).          */
+/*                                                                      */
+/*   /D          debug output on the console                            */
+/*   /P=n        boot from partition n (1-4)                            */
+/*   /W=n        SPI wiring: 0 bit-bang, 1 shift register, 2 CA2        */
+/*   /S=n        fix the SPI bit delay at n instead of calibrating it   */
+/*   /C=n        sector cache of n slots, 512 bytes each (default 0)    */
+/*   /F=n        shadow up to n sectors of FAT #1 + root (default 0)    */
+/*   /L=n        write-back, flush at n dirty sectors (needs /C)        */
+/*   /A          FAT-chain read-ahead into the cache (needs /C and /F)  */
+/*   /R=lbn,cnt  pin a range of sectors in the cache (needs /C)         */
+/*   /I=n        INT 28h idle slice of n ms                             */
+/*   /T[=n]      trace to the card, n = 1 errors, 2 requests, 3 all     */
+/*   /K, /B=n    accepted and ignored, left from the parallel port code */
+/*                                                                      */
+/* The cache and the shadow are resident, so they are off unless asked */
+/* for: /C=16 /F=64 costs about 40K of memory.                          */
 bool parse_options (char far *p)
 {
-  uint16_t temp;
+  uint16_t temp, temp2;
   while (*p!=' ' && *p!='\t' && !iseol(*p))  ++p;
   p = spanwhite(p);
   while (!iseol(*p)) {
@@ -258,6 +327,30 @@ bool parse_options (char far *p)
         debug = TRUE;
         cdprintf("Parsing debug as true\n");
         break;
+    case 'a':
+    case 'A':
+        prefetch_on = TRUE;
+        break;
+    case 't':
+    case 'T':
+        /* /T records errors and request summaries, /T=n picks the level */
+        log_level = LOG_INFO;
+        if (*p == '=') {
+            if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+            if (temp > LOG_DEBUG)
+                cdprintf("SD: Invalid trace level %d\n",temp);
+            else
+                log_level = temp;
+        }
+        break;
+    case 'i':
+    case 'I':
+        if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+        if (temp > 0xFFFF / VIA_TICKS_PER_MS)
+            cdprintf("SD: Invalid idle budget %d\n",temp);
+        else
+            idle_budget = temp * VIA_TICKS_PER_MS;
+        break;
     case 'k':
     case 'K':
         //sd_card_check = 1;
@@ -271,6 +364,51 @@ bool parse_options (char far *p)
             partition_number = temp;
             cdprintf("SD: partition number: %d\n", partition_number);
         break; 
+    case 's':
+    case 'S':
+        if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+        bit_delay_us = temp;
+        bit_delay_fixed = true;
+        if (debug) cdprintf("SD: SPI bit delay fixed at %d\n", bit_delay_us);
+        break;
+    case 'c':
+    case 'C':
+        if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+        if (temp > CACHE_MAX_SLOTS)
+            cdprintf("SD: Invalid cache size %d\n",temp);
+        else
+            cache_slots = temp;
+        break;
+    case 'f':
+    case 'F':
+        if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+        if (temp > SHADOW_MAX_SECTORS)
+            cdprintf("SD: Invalid FAT shadow size %d\n",temp);
+        else
+            shadow_max = temp;
+        break;
+    case 'l':
+    case 'L':
+        if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+        if (temp > CACHE_MAX_SLOTS)
+            cdprintf("SD: Invalid write-back limit %d\n",temp);
+        else
+            dirty_limit = temp;
+        break;
+    case 'r':
+    case 'R':
+        if ((p=option_range(p,&temp,&temp2)) == FALSE)  return FALSE;
+        if (!cache_preload_add(temp, temp2))
+            cdprintf("SD: Too many preload ranges\n");
+        break;
+    case 'w':
+    case 'W':
+        if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
+        if (temp > 2)
+            cdprintf("SD: Invalid SPI wiring %d\n",temp);
+        else
+            spi_wiring = temp;
+        break;
     case 'b': 
     case 'B':
         if ((p=option_value(p,&temp)) == FALSE)  return FALSE;
@@ -28,6 +28,18 @@ typedef enum {
 
 void setportbase(uint8_t val);  /* set the port base */
 
+void via_timer_start (void);
+uint16_t via_timer_elapsed (void);
+
+extern uint16_t bit_delay_us;   /* SPI half-bit delay, 0 = full speed */
+extern bool bit_delay_fixed;    /* TRUE if set by /S=n, skips calibration */
+extern uint8_t spi_wiring;       /* /W=n: 0 bit-bang, 1 VIA shift reg, 2 CA2 SCLK */
+extern uint8_t spi_backend;      /* What disk_initialize() settled on, SPI_* */
+#define SPI_BITBANG    0     /* Every edge driven from PA1 */
+#define SPI_SHIFTREG   1     /* Receive through the VIA shift register */
+#define SPI_CA2        2     /* SCLK pulsed by CA2 on every ORA write */
+extern uint16_t data_blocks;     /* 512 byte data packets moved to/from the card, wraps */
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
@@ -37,6 +49,11 @@ DRESULT disk_result (uint8_t pdrv);
 DRESULT disk_read (uint8_t pdrv, uint8_t far * buff, uint32_t sector, uint16_t count);
 DRESULT disk_write (uint8_t pdrv, const uint8_t far * buff, uint32_t sector, uint16_t count);
 DRESULT disk_ioctl (uint8_t pdrv, uint8_t cmd, void far * buff);
+DRESULT disk_flush (uint8_t pdrv);
+DRESULT disk_stop (uint8_t pdrv);
+DRESULT disk_write_begin (uint8_t pdrv, uint32_t sector);
+DRESULT disk_read_begin (uint8_t pdrv, uint32_t sector);
+bool disk_streaming (void);
 
 
 /* Disk Status Bits (DSTATUS) */
@@ -80,6 +97,15 @@ DRESULT disk_ioctl (uint8_t pdrv, uint8_t cmd, void far * buff);
 #define CT_SDC    (CT_SD1|CT_SD2)   /* SD */
 #define CT_BLOCK  0x08     /* Block addressing */
 
+/* Step a far buffer pointer one sector ahead by segment instead of by   */
+/* offset, so a transfer of any length never wraps the 16-bit offset.    */
+/* The host simulator has flat pointers.                                 */
+#ifdef SDSIM
+#define NEXT_SECTOR(p) ((p) += 512)
+#else
+#define NEXT_SECTOR(p) ((p) = MK_FP(FP_SEG(p) + (512 >> 4), FP_OFF(p)))
+#endif
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,21 @@
+/* logsites.h - the trace record sites                                  */
+/*                                                                      */
+/*   One LOG_SITE(id, level, format) per LOGn() call site.  cprint.h   */
+/* includes this file to number the sites and give each its level, and  */
+/* readlog.py parses it to format the records, so keep each entry on    */
+/* one line.  The format takes %d %u %x (16 bit), %ld %lu %X (32 bit)   */
+/* and %p (far pointer), one per argument.  Only add sites at the end,  */
+/* or traces taken with an older driver will no longer decode.          */
+
+LOG_SITE(LS_MEDIA_CHECK,  LOG_INFO,  "mediaCheck: unit %x media %x ret %d request %p")
+LOG_SITE(LS_BUILD_BPB,    LOG_INFO,  "buildBpb: media %x fat %p bpb %p")
+LOG_SITE(LS_IOCTL_IN,     LOG_INFO,  "IOCTLInput: type %x")
+LOG_SITE(LS_IOCTL_OUT,    LOG_INFO,  "IOCTLOutput: type %x")
+LOG_SITE(LS_DRIVE_ERROR,  LOG_ERR,   "unknown drive error, status %x")
+LOG_SITE(LS_READ,         LOG_DEBUG, "read: start %u count %u buffer %p media %x")
+LOG_SITE(LS_WRITE,        LOG_DEBUG, "write: start %u count %u buffer %p verify %d")
+LOG_SITE(LS_READ_ERROR,   LOG_ERR,   "read error: status %d start %u count %u")
+LOG_SITE(LS_WRITE_ERROR,  LOG_ERR,   "write error: status %d start %u count %u")
+LOG_SITE(LS_INIT_BPB,     LOG_DEBUG, "init: bpb %p")
+LOG_SITE(LS_ACCESS_READ,  LOG_INFO,  "access read: unit %x start %lu count %u tick %lu")
+LOG_SITE(LS_ACCESS_WRITE, LOG_INFO,  "access write: unit %x start %lu count %u tick %lu")
@@ -1,26 +1,396 @@
-def read_bpb(filename):
-    with open(filename, 'rb') as f:
-        boot_sector = f.read(512)
+import sys
 
-    bpb = {
-        'BytesPerSector': int.from_bytes(boot_sector[11:13], 'little'),
+# Volume layout analyzer for SD card images.
+#
+#   readbpb.py [-p n] [-e KB] [-r n] [-n bytes] [-1] [-v] image...
+#
+# An image can be a whole card or just a volume's boot sector
+# (bootsector.bin, the default), which gets its BPB and layout printed.
+# Finds the FAT volume the way find_volume() in sd.c does (sector 0 as a
+# boot sector, else the MBR partitions, -p n forcing one like /P=n),
+# prints its BPB and layout, and walks the directory tree.  For every
+# file it reports how many extents (runs of contiguous clusters) it is
+# split into, and estimates what reading it costs over SPI with the
+# driver's disk_read(): SD commands sent and SCLK edges, and how much of
+# that is down to fragmentation.  Each image ends with a summary, so a
+# batch of images shows which are slow because of their layout rather
+# than because of the driver.
+#
+# The estimate replays DOS reading each file front to back, in requests
+# of up to -r sectors (128, a 64K buffer), following the chain through
+# FAT #1 with one FAT sector buffered, and no driver cache.  disk_read()
+# is modelled as it stands: an isolated single sector is a CMD17, a run
+# with CMD23 support is CMD23 + CMD18 with a counted length, and a read
+# that follows on from the last one continues or opens a CMD18 that
+# stays open until a read elsewhere stops it with CMD12.  -1 models a
+# card without CMD23.  Each SPI byte is 16 SCLK edges.  A command costs
+# the deselect and select dummy clocks, one ready poll, the 6 command
+# bytes, and the Ncr byte and R1.  A data block costs -n bytes of Nac
+# before its token (4 by default), the token, 512 bytes and CRC.  Busy
+# and token polls beyond that depend on the card and are not counted.
+#
+# -e gives the card's erase unit (allocation unit) in KB, 4096 by
+# default, for the alignment report.  -v lists every file, not only the
+# fragmented ones.
+
+SECTOR_SIZE = 512
+DIR_ENTRY = 32
+
+EDGES_PER_BYTE = 16              # A rising and a falling edge per bit
+COMMAND_BYTES = 11               # deselect, select, ready, 6 command, Ncr, R1
+STOP_BYTES = 10                  # CMD12: 6 command, stuff byte, R1, ready, deselect
+BLOCK_BYTES = 1 + 512 + 2        # Token, data, CRC
+
+MAX_REQUEST = 128
+NAC_BYTES = 4
+ERASE_UNIT_KB = 4096
+
+ATTR_VOLUME = 0x08
+ATTR_DIRECTORY = 0x10
+ATTR_LFN = 0x0F
+
+
+def le16(data, offset):
+    return int.from_bytes(data[offset:offset + 2], 'little')
+
+
+def le32(data, offset):
+    return int.from_bytes(data[offset:offset + 4], 'little')
+
+
+class Image:
+    def __init__(self, filename):
+        self.f = open(filename, 'rb')
+
+    def read(self, lba, count=1):
+        self.f.seek(lba * SECTOR_SIZE)
+        data = self.f.read(count * SECTOR_SIZE)
+        return data + bytes(count * SECTOR_SIZE - len(data))
+
+    def close(self):
+        self.f.close()
+
+
+def check_fs(image, lba):
+    # As check_fs() in sd.c: 0 FAT boot sector, 1 boot sector but not
+    # FAT, 2 not a boot sector
+    sector = image.read(lba)
+    if le16(sector, 510) != 0xAA55:
+        return 2, sector
+    if sector[54:57] == b'FAT' or sector[82:85] == b'FAT':
+        return 0, sector
+    return 1, sector
+
+
+def find_volume(image, partno=0):
+    # Returns (partition offset, boot sector), or (None, reason)
+    bsect = 0
+    fmt, sector = check_fs(image, bsect)
+    if fmt == 1 or (fmt == 0 and partno):
+        table = [le32(sector, 0x1BE + 16 * i + 8) if sector[0x1BE + 16 * i + 4] else 0
+                 for i in range(4)]
+        i = partno - 1 if partno else 0
+        while True:
+            bsect = table[i]
+            fmt, boot = check_fs(image, bsect) if bsect else (2, None)
+            i += 1
+            if partno or fmt == 0 or i == 4:
+                break
+        sector = boot
+    if fmt != 0:
+        return None, "no FAT volume found"
+    if le16(sector, 11) != SECTOR_SIZE:
+        return None, "sector size is not 512"
+    return bsect, sector
+
+
+def read_bpb(boot_sector):
+    return {
+        'BytesPerSector': le16(boot_sector, 11),
         'SectorsPerCluster': boot_sector[13],
-        'ReservedSectors': int.from_bytes(boot_sector[14:16], 'little'),
+        'ReservedSectors': le16(boot_sector, 14),
         'NumberOfFATs': boot_sector[16],
-        'RootEntries': int.from_bytes(boot_sector[17:19], 'little'),
-        'TotalSectors16': int.from_bytes(boot_sector[19:21], 'little'),
+        'RootEntries': le16(boot_sector, 17),
+        'TotalSectors16': le16(boot_sector, 19),
         'MediaDescriptor': boot_sector[21],
-        'SectorsPerFAT16': int.from_bytes(boot_sector[22:24], 'little'),
-        'SectorsPerTrack': int.from_bytes(boot_sector[24:26], 'little'),
-        'Heads': int.from_bytes(boot_sector[26:28], 'little'),
-        'HiddenSectors': int.from_bytes(boot_sector[28:32], 'little'),
-        'TotalSectors32': int.from_bytes(boot_sector[32:36], 'little'),
+        'SectorsPerFAT16': le16(boot_sector, 22),
+        'SectorsPerTrack': le16(boot_sector, 24),
+        'Heads': le16(boot_sector, 26),
+        'HiddenSectors': le32(boot_sector, 28),
+        'TotalSectors32': le32(boot_sector, 32),
     }
 
-    # Print BPB
+
+class Volume:
+    # Sector numbers are relative to the partition, as DOS asks for them
+    def __init__(self, image, offset, bpb):
+        self.image = image
+        self.offset = offset
+        self.cluster_secs = bpb['SectorsPerCluster']
+        self.fat_start = bpb['ReservedSectors']
+        self.fat_secs = bpb['SectorsPerFAT16']
+        self.root_start = self.fat_start + bpb['NumberOfFATs'] * self.fat_secs
+        self.root_secs = (bpb['RootEntries'] * DIR_ENTRY + SECTOR_SIZE - 1) // SECTOR_SIZE
+        self.data_start = self.root_start + self.root_secs
+        total = bpb['TotalSectors16'] or bpb['TotalSectors32']
+        self.clusters = (total - self.data_start) // self.cluster_secs
+        self.fat16 = self.clusters >= 4085
+        self.fat = image.read(offset + self.fat_start, self.fat_secs)
+
+    def read(self, lbn, count=1):
+        return self.image.read(self.offset + lbn, count)
+
+    def cluster_lbn(self, cluster):
+        return self.data_start + (cluster - 2) * self.cluster_secs
+
+    def fat_offset(self, cluster):
+        return cluster * 2 if self.fat16 else cluster + cluster // 2
+
+    def fat_sector(self, cluster):
+        return self.fat_start + self.fat_offset(cluster) // SECTOR_SIZE
+
+    def next_cluster(self, cluster):
+        offset = self.fat_offset(cluster)
+        if self.fat16:
+            value = le16(self.fat, offset)
+            return None if value >= 0xFFF8 else value
+        value = le16(self.fat, offset)
+        value = value >> 4 if cluster & 1 else value & 0xFFF
+        return None if value >= 0xFF8 else value
+
+    def chain(self, first):
+        clusters, seen = [], set()
+        cluster = first
+        while cluster is not None and 2 <= cluster < self.clusters + 2 and cluster not in seen:
+            seen.add(cluster)
+            clusters.append(cluster)
+            cluster = self.next_cluster(cluster)
+        return clusters
+
+    def walk(self, clusters=None, path=''):
+        # Yields (path, attributes, size, clusters) for every file and
+        # directory below the root, or below the directory in clusters
+        if clusters is None:
+            data = self.read(self.root_start, self.root_secs)
+        else:
+            data = b''.join(self.read(self.cluster_lbn(c), self.cluster_secs) for c in clusters)
+        for pos in range(0, len(data), DIR_ENTRY):
+            entry = data[pos:pos + DIR_ENTRY]
+            if entry[0] == 0x00:
+                break
+            attr = entry[11]
+            if entry[0] == 0xE5 or attr == ATTR_LFN or attr & ATTR_VOLUME:
+                continue
+            name = entry[0:8].decode('ascii', 'replace').rstrip()
+            ext = entry[8:11].decode('ascii', 'replace').rstrip()
+            if name in ('.', '..'):
+                continue
+            name = f"{path}\\{name}.{ext}" if ext else f"{path}\\{name}"
+            chain = self.chain(le16(entry, 26))
+            yield name, attr, le32(entry, 28), chain
+            if attr & ATTR_DIRECTORY:
+                yield from self.walk(chain, name)
+
+
+def extents(volume, clusters):
+    # [(first sector, sectors)] of the contiguous runs in a chain
+    runs = []
+    for cluster in clusters:
+        lbn = volume.cluster_lbn(cluster)
+        if runs and runs[-1][0] + runs[-1][1] == lbn:
+            runs[-1][1] += volume.cluster_secs
+        else:
+            runs.append([lbn, volume.cluster_secs])
+    return runs
+
+
+class SpiCost:
+    # disk_read()'s command sequence, counting commands and SPI bytes
+    def __init__(self, cmd23=True, nac=NAC_BYTES):
+        self.cmd23 = cmd23
+        self.nac = nac
+        self.commands = 0
+        self.bytes = 0
+        self.streaming = False
+        self.stream_next = None
+        self.last_end = None
+
+    def command(self, n=1):
+        self.commands += n
+        self.bytes += n * COMMAND_BYTES
+
+    def read(self, lbn, count):
+        self.bytes += count * (self.nac + BLOCK_BYTES)
+        if self.streaming and lbn == self.stream_next:
+            self.stream_next += count
+            self.last_end = self.stream_next
+            return
+        if self.streaming:
+            self.commands += 1
+            self.bytes += STOP_BYTES
+            self.streaming = False
+        if count == 1 and lbn != self.last_end:
+            self.command()                   # CMD17
+        elif self.cmd23 and lbn != self.last_end:
+            self.command(2)                  # CMD23 + CMD18, stops by itself
+        else:
+            self.command()                   # CMD18, left open
+            self.streaming = True
+            self.stream_next = lbn + count
+        self.last_end = lbn + count
+
+    def edges(self):
+        return self.bytes * EDGES_PER_BYTE
+
+
+def file_cost(volume, clusters, sectors, cmd23, nac, max_request):
+    # Commands and edges to read the first sectors of a chain as DOS would
+    cost = SpiCost(cmd23, nac)
+    fat_buffered = None
+    left = sectors
+    i = 0
+    while left > 0 and i < len(clusters):
+        # Follow the chain over the next contiguous run, reading FAT
+        # sectors as DOS needs them, then read the run's data
+        first = volume.cluster_lbn(clusters[i])
+        run = 0
+        while i < len(clusters) and volume.cluster_lbn(clusters[i]) == first + run:
+            fat = volume.fat_sector(clusters[i])
+            if fat != fat_buffered:
+                cost.read(fat, 1)
+                fat_buffered = fat
+            run += volume.cluster_secs
+            i += 1
+        run = min(run, left)
+        left -= run
+        lbn = first
+        while run > 0:
+            count = min(run, max_request)
+            cost.read(lbn, count)
+            lbn += count
+            run -= count
+    return cost
+
+
+def contiguous_cost(volume, clusters, sectors, cmd23, nac, max_request):
+    # The same file laid out in one run from its first cluster
+    if not clusters:
+        return SpiCost(cmd23, nac)
+    start = clusters[0]
+    ideal = list(range(start, start + len(clusters)))
+    return file_cost(volume, ideal, sectors, cmd23, nac, max_request)
+
+
+def print_bpb(bpb):
     for key, value in bpb.items():
-        print(f"{key}: {value}")
+        print(f"  {key}: {value}")
 
-if __name__ == '__main__':
-    read_bpb('bootsector.bin')
 
+def print_layout(volume, erase_kb):
+    erase = erase_kb * 1024 // SECTOR_SIZE
+    cluster = volume.cluster_secs
+
+    def where(lbn):
+        absolute = volume.offset + lbn
+        return f"sector {absolute:>8}, {absolute % erase * SECTOR_SIZE // 1024:>5}K into its erase unit"
+
+    print(f"  FAT{16 if volume.fat16 else 12}, {volume.clusters} clusters of "
+          f"{cluster * SECTOR_SIZE // 1024 if cluster >= 2 else 0.5}K")
+    print(f"  partition   {where(0)}")
+    print(f"  FAT #1      {where(volume.fat_start)}")
+    print(f"  root        {where(volume.root_start)}")
+    print(f"  data area   {where(volume.data_start)}")
+    misaligned = (volume.offset + volume.data_start) % cluster
+    if (volume.offset + volume.data_start) % erase == 0:
+        print(f"  data area is aligned to the {erase_kb}K erase unit")
+    elif misaligned or erase % cluster:
+        print(f"  clusters straddle erase unit boundaries "
+              f"(data area {misaligned} sector{'s' if misaligned != 1 else ''} off a cluster boundary)")
+    else:
+        print(f"  clusters do not straddle erase units, but the data area is not aligned")
+    if volume.offset % erase:
+        print(f"  partition does not start on an erase unit boundary")
+
+
+def analyze(filename, partno, erase_kb, cmd23, nac, max_request, verbose):
+    image = Image(filename)
+    offset, boot = find_volume(image, partno)
+    print(f"{filename}:")
+    if offset is None:
+        print(f"  {boot}")
+        image.close()
+        return
+    bpb = read_bpb(boot)
+    print_bpb(bpb)
+    volume = Volume(image, offset, bpb)
+    print_layout(volume, erase_kb)
+
+    files = fragmented = 0
+    total = SpiCost()
+    ideal_total = SpiCost()
+    rows = []
+    for path, attr, size, clusters in volume.walk():
+        if attr & ATTR_DIRECTORY:
+            continue
+        sectors = (size + SECTOR_SIZE - 1) // SECTOR_SIZE
+        used = clusters[:(sectors + volume.cluster_secs - 1) // volume.cluster_secs]
+        runs = extents(volume, used)
+        cost = file_cost(volume, used, sectors, cmd23, nac, max_request)
+        ideal = contiguous_cost(volume, used, sectors, cmd23, nac, max_request)
+        files += 1
+        if len(runs) > 1:
+            fragmented += 1
+        for t, c in ((total, cost), (ideal_total, ideal)):
+            t.commands += c.commands
+            t.bytes += c.bytes
+        if verbose or len(runs) > 1:
+            rows.append((cost.edges() - ideal.edges(), path, size, len(runs), cost, ideal))
+
+    if rows:
+        # The last two columns are what the layout adds over a contiguous file
+        print(f"  {'file':<32} {'bytes':>9} {'extents':>7} {'commands':>8} "
+              f"{'SCLK edges':>11} {'extra':>5} {'edges':>7}")
+        for extra, path, size, count, cost, ideal in sorted(rows, key=lambda r: -r[0]):
+            excess = 100.0 * extra / ideal.edges() if ideal.edges() else 0.0
+            print(f"  {path:<32} {size:>9} {count:>7} {cost.commands:>8} "
+                  f"{cost.edges():>11} {cost.commands - ideal.commands:>+5} {excess:>+6.1f}%")
+    excess = (100.0 * (total.edges() - ideal_total.edges()) / ideal_total.edges()
+              if ideal_total.edges() else 0.0)
+    print(f"  {files} files, {fragmented} fragmented; reading them all takes "
+          f"{total.commands} commands and {total.edges()} SCLK edges, "
+          f"{total.commands - ideal_total.commands:+} commands and {excess:+.1f}% "
+          f"edges against contiguous files")
+    image.close()
+
+
+def main(argv):
+    partno, erase_kb, cmd23, nac, max_request, verbose = 0, ERASE_UNIT_KB, True, NAC_BYTES, MAX_REQUEST, False
+    files = []
+    args = iter(argv)
+    for arg in args:
+        if arg == '-p':
+            partno = int(next(args))
+        elif arg == '-e':
+            erase_kb = int(next(args))
+        elif arg == '-r':
+            max_request = int(next(args))
+        elif arg == '-n':
+            nac = int(next(args))
+        elif arg == '-1':
+            cmd23 = False
+        elif arg == '-v':
+            verbose = True
+        else:
+            files.append(arg)
+    status = 0
+    for filename in files or ['bootsector.bin']:
+        try:
+            analyze(filename, partno, erase_kb, cmd23, nac, max_request, verbose)
+        except OSError as e:
+            print(f"{filename}: {e.strerror}")
+            status = 1
+    return status
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,115 @@
+import os
+import re
+import struct
+import sys
+
+# Layout of the driver's trace sectors, see LogSector in cprint.h
+LOG_SECTOR_START = 15
+LOG_CARD_SECTORS = 17
+LOG_MAGIC = b'SDTR'
+LOG_HEADER = struct.Struct('<4sIHH')
+SECTOR_SIZE = 512
+
+SITE_LINE = re.compile(r'^LOG_SITE\(\s*(\w+),\s*(\w+),\s*"(.*)"\)')
+SPEC = re.compile(r'%(l?[dux]|X|p)')
+
+
+def read_sites(filename):
+    # Site numbers follow the order of logsites.h, starting at 1 (LS_NONE is 0)
+    sites = [None]
+    with open(filename) as f:
+        for line in f:
+            m = SITE_LINE.match(line.strip())
+            if m:
+                sites.append((m.group(1), m.group(2), m.group(3)))
+    return sites
+
+
+def format_arg(spec, value):
+    if spec == 'd':
+        value &= 0xFFFF
+        return str(value - 0x10000 if value & 0x8000 else value)
+    if spec == 'u':
+        return str(value & 0xFFFF)
+    if spec == 'x':
+        return f"{value & 0xFFFF:04X}"
+    if spec == 'ld':
+        return str(value - 0x100000000 if value & 0x80000000 else value)
+    if spec == 'lu':
+        return str(value)
+    if spec in ('X', 'lx'):
+        return f"{value:08X}"
+    if spec == 'p':
+        return f"{value >> 16:04X}:{value & 0xFFFF:04X}"
+    return f"?{value:X}"
+
+
+def parse_record(sites, data, pos):
+    # Returns (site name, arguments, next position), or (None, None, None)
+    # if the record is bad
+    site = data[pos]
+    if site == 0 or site >= len(sites):
+        return None, None, None
+    name, level, fmt = sites[site]
+    count = len(SPEC.findall(fmt))
+    end = pos + 1 + 4 * count
+    if end > len(data):
+        return None, None, None
+    return name, struct.unpack_from(f'<{count}I', data, pos + 1), end
+
+
+def format_record(sites, data, pos):
+    # Returns (text, next position), or (None, None) if the record is bad
+    name, args, end = parse_record(sites, data, pos)
+    if name is None:
+        return None, None
+    fmt = sites[data[pos]][2]
+    values = iter(format_arg(spec, value) for spec, value in zip(SPEC.findall(fmt), args))
+    return SPEC.sub(lambda m: next(values), fmt), end
+
+
+def read_log_sectors(filename):
+    sectors = []
+    with open(filename, 'rb') as f:
+        f.seek(LOG_SECTOR_START * SECTOR_SIZE)
+        for slot in range(LOG_CARD_SECTORS):
+            data = f.read(SECTOR_SIZE)
+            if len(data) < SECTOR_SIZE:
+                break
+            magic, seq, used, dropped = LOG_HEADER.unpack_from(data)
+            if magic != LOG_MAGIC:
+                continue
+            # A sector torn by an overrun can claim more than it holds
+            used = min(used, SECTOR_SIZE - LOG_HEADER.size)
+            sectors.append((seq, slot, dropped, data[LOG_HEADER.size:LOG_HEADER.size + used]))
+    return sorted(sectors)
+
+
+def read_log(filename, sites_file):
+    sites = read_sites(sites_file)
+    sectors = read_log_sectors(filename)
+    if not sectors:
+        print(f"{filename}: no trace sectors found")
+        return
+
+    print(f"Trace sectors {sectors[0][0]}..{sectors[-1][0]}")
+    previous = None
+    for seq, slot, dropped, data in sectors:
+        if previous is not None and seq != previous + 1:
+            print(f"--- sectors {previous + 1}..{seq - 1} missing (overwritten or lost) ---")
+        if dropped:
+            print(f"--- {dropped} bytes dropped (ring overrun) ---")
+        pos = 0
+        while pos < len(data):
+            text, pos = format_record(sites, data, pos)
+            if text is None:
+                print(f"--- sector {seq}: undecodable record, rest skipped ---")
+                break
+            print(text)
+        previous = seq
+
+
+if __name__ == '__main__':
+    here = os.path.dirname(os.path.abspath(__file__))
+    read_log(sys.argv[1] if len(sys.argv) > 1 else 'sdcard.img',
+             sys.argv[2] if len(sys.argv) > 2 else os.path.join(here, 'logsites.h'))
@@ -208,6 +208,48 @@ bool sd_media_check (uint8_t unit)
   return (disk_result(unit) == RES_OK) ? FALSE : TRUE;
 }
 
+/* sd_sync */
+/*   Ends any multi-block transfer left open on the card and waits until */
+/* it is ready.  Call before anything that must not find the card in the */
+/* middle of a transfer.                                                 */
+int sd_sync (uint16_t unit)
+{
+  return disk_ioctl (unit, CTRL_SYNC, NULL);
+}
+
+/* sd_flush */
+/*   Closes a multi-block write left open on the card and waits until    */
+/* everything DOS has written, a lone CMD24 block included, is           */
+/* programmed.  An open read is left running.                            */
+int sd_flush (uint16_t unit)
+{
+  return disk_flush (unit);
+}
+
+/* sd_stop */
+/*   Closes a multi-block transfer left open on the card without waiting */
+/* for the card to program what was written; the next command does.     */
+int sd_stop (uint16_t unit)
+{
+  return disk_stop (unit);
+}
+
+/* sd_write_begin */
+/*   Opens a multi-block write at lbn for a run of one-sector sd_write()  */
+/* calls that come from buffers which are not contiguous in memory.     */
+int sd_write_begin (uint16_t unit, uint32_t lbn)
+{
+  return disk_write_begin (unit, lbn + partition_offset);
+}
+
+/* sd_read_begin */
+/*   Opens a multi-block read at lbn for a run of one-sector sd_read()   */
+/* calls into buffers which are not contiguous in memory.               */
+int sd_read_begin (uint16_t unit, uint32_t lbn)
+{
+  return disk_read_begin (unit, lbn + partition_offset);
+}
+
 /* sd_read */
 /*  IMPORTANT!  Blocks are always 512 uint8_ts!  Never more, never less.   */
 /*                         */
@@ -20,6 +20,21 @@ int sd_read (uint16_t, uint32_t, uint8_t far *, uint16_t count);
 /* sd_write - write one 512 uint8_t logical block to the tape */
 int sd_write (uint16_t, uint32_t, uint8_t far *, uint16_t count);
 
+/* sd_sync - close any open multi-block transfer */
+int sd_sync (uint16_t unit);
+
+/* sd_flush - close an open multi-block write, wait out programming */
+int sd_flush (uint16_t unit);
+
+/* sd_stop - close an open multi-block transfer without waiting */
+int sd_stop (uint16_t unit);
+
+/* sd_write_begin - open a multi-block write for a run of sd_write() calls */
+int sd_write_begin (uint16_t unit, uint32_t lbn);
+
+/* sd_read_begin - open a multi-block read for a run of sd_read() calls */
+int sd_read_begin (uint16_t unit, uint32_t lbn);
+
 /* sd_media_check - check if media changed */
 bool sd_media_check (uint8_t unit);
 
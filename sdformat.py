@@ -0,0 +1,214 @@
+import os
+import struct
+import sys
+import time
+
+# SD-aligned formatter for Victor DOS card images.
+#
+#   sdformat.py [-s MB] [-a KB] [-g KB] [-c n] [-r n] [-L label] image
+#
+# Writes an MBR with one FAT12/16 partition and formats it so that the
+# data area starts exactly on an allocation unit (AU, -a, 4096K) of the
+# card, and FAT #1, FAT #2 and the root directory each start on a -g
+# boundary (16K, the size a card programs at once) inside the AU in
+# front of it.  Every cluster write then stays inside one AU and, for
+# clusters of at least -g, starts on a program boundary, where DOS
+# FORMAT's layout has them straddle both.
+#
+# The FAT and the root directory are padded to whole -g units, and the
+# partition starts -g sectors in front of FAT #1, which are its reserved
+# sectors (only the boot sector is used).  The volume stays within what
+# the driver and Victor DOS 3.1 handle: 512 byte sectors and a 16 bit
+# sector count, so at most 65535 sectors (32M) whatever the card's size.
+# Clusters are -c sectors, 4 by default like FORMAT; a volume of fewer
+# than 4085 clusters is FAT12.
+# The trace sectors the driver keeps in front of the partition (/T) are
+# left free.
+#
+# The image is created -s MB large, or formatted in place if it exists
+# and -s is not given.  Check the result with readbpb.py.
+
+SECTOR_SIZE = 512
+DIR_ENTRY = 32
+MAX_SECTORS = 0xFFFF             # bpb_nsize is 16 bit
+FAT12_MAX_CLUSTERS = 4084
+FAT16_MAX_CLUSTERS = 65524
+TRACE_END = 32                   # LOG_SECTOR_START + LOG_CARD_SECTORS
+
+AU_KB = 4096
+GRAIN_KB = 16
+CLUSTER_SECTORS = 4
+ROOT_ENTRIES = 512
+MEDIA = 0xF8
+
+
+def round_up(n, unit):
+    return (n + unit - 1) // unit * unit
+
+
+def fat_sectors(clusters, fat16):
+    entries = clusters + 2
+    size = entries * 2 if fat16 else (entries * 3 + 1) // 2
+    return (size + SECTOR_SIZE - 1) // SECTOR_SIZE
+
+
+def plan(card_sectors, au, grain, cluster, root_entries):
+    # Returns the layout, in card sectors, or raises ValueError
+    if au % grain:
+        raise ValueError("the AU must be a multiple of -g")
+    root_secs = round_up(root_entries * DIR_ENTRY, SECTOR_SIZE) // SECTOR_SIZE
+    root_secs = round_up(root_secs, grain)
+    reserved = grain
+    fat16 = True
+    spf = grain
+    while True:
+        # Size the FAT for the clusters that fit, in whole grains so that
+        # FAT #2 and the root directory start on grain boundaries too
+        system = 2 * spf + root_secs
+        data_start = round_up(TRACE_END + reserved + system, au)
+        start = data_start - system - reserved
+        total = min(MAX_SECTORS, card_sectors - start)
+        clusters = (total - reserved - system) // cluster
+        if clusters <= 0:
+            raise ValueError("the card is too small for an AU-aligned volume")
+        if fat16 and clusters <= FAT12_MAX_CLUSTERS:
+            fat16 = False
+            continue
+        need = round_up(fat_sectors(clusters, fat16), grain)
+        if need <= spf:
+            break
+        spf = need
+    if clusters > FAT16_MAX_CLUSTERS:
+        raise ValueError(f"{clusters} clusters is too many for FAT16, use a larger -c")
+    # Leave out the partial cluster at the end
+    total = reserved + system + clusters * cluster
+    return {
+        'start': start, 'total': total, 'reserved': reserved, 'spf': spf,
+        'root_secs': root_secs, 'root_entries': root_secs * SECTOR_SIZE // DIR_ENTRY,
+        'cluster': cluster, 'clusters': clusters, 'fat16': fat16, 'data': data_start,
+    }
+
+
+def chs(lba):
+    # 255 heads, 63 sectors; nobody on the Victor reads these
+    cylinder = min(lba // (255 * 63), 1023)
+    head = lba // 63 % 255
+    sector = lba % 63 + 1
+    return bytes([head, sector | (cylinder >> 8) << 6, cylinder & 0xFF])
+
+
+def mbr(layout):
+    sector = bytearray(SECTOR_SIZE)
+    kind = 0x04 if layout['fat16'] else 0x01     # FAT16 < 32M, FAT12
+    entry = (bytes([0x00]) + chs(layout['start']) + bytes([kind])
+             + chs(layout['start'] + layout['total'] - 1)
+             + struct.pack('<II', layout['start'], layout['total']))
+    sector[0x1BE:0x1BE + 16] = entry
+    sector[510:512] = b'\x55\xAA'
+    return bytes(sector)
+
+
+def boot_sector(layout, label):
+    sector = bytearray(SECTOR_SIZE)
+    sector[0:3] = b'\xEB\x3C\x90'
+    sector[3:11] = b'SDFORMAT'
+    struct.pack_into('<HBHBHHBHHHII', sector, 11,
+                     SECTOR_SIZE, layout['cluster'], layout['reserved'], 2,
+                     layout['root_entries'], layout['total'], MEDIA, layout['spf'],
+                     63, 255, layout['start'], 0)
+    sector[36] = 0x80                            # Drive number
+    sector[38] = 0x29                            # Extended boot signature
+    struct.pack_into('<I', sector, 39, int(time.time()) & 0xFFFFFFFF)
+    sector[43:54] = label.ljust(11)[:11].encode('ascii')
+    sector[54:62] = b'FAT16   ' if layout['fat16'] else b'FAT12   '
+    sector[62] = 0xF4                            # hlt, not bootable
+    sector[510:512] = b'\x55\xAA'
+    return bytes(sector)
+
+
+def first_fat_sector(layout):
+    sector = bytearray(SECTOR_SIZE)
+    if layout['fat16']:
+        sector[0:4] = bytes([MEDIA, 0xFF, 0xFF, 0xFF])
+    else:
+        sector[0:3] = bytes([MEDIA, 0xFF, 0xFF])
+    return bytes(sector)
+
+
+def volume_label(label):
+    entry = bytearray(DIR_ENTRY)
+    entry[0:11] = label.ljust(11)[:11].encode('ascii')
+    entry[11] = 0x08
+    return bytes(entry)
+
+
+def format_image(filename, size_mb, au_kb, grain_kb, cluster, root_entries, label):
+    if size_mb:
+        card_sectors = size_mb * 1024 * 1024 // SECTOR_SIZE
+    else:
+        card_sectors = os.path.getsize(filename) // SECTOR_SIZE
+    layout = plan(card_sectors, au_kb * 1024 // SECTOR_SIZE, grain_kb * 1024 // SECTOR_SIZE,
+                  cluster, root_entries)
+
+    with open(filename, 'wb' if size_mb else 'r+b') as f:
+        def put(lba, data):
+            f.seek(lba * SECTOR_SIZE)
+            f.write(data)
+
+        start = layout['start']
+        fat1 = start + layout['reserved']
+        root = fat1 + 2 * layout['spf']
+        put(0, mbr(layout))
+        put(start, boot_sector(layout, label))
+        put(start + 1, bytes((layout['reserved'] - 1) * SECTOR_SIZE))
+        for fat in (fat1, fat1 + layout['spf']):
+            put(fat, first_fat_sector(layout))
+            put(fat + 1, bytes((layout['spf'] - 1) * SECTOR_SIZE))
+        put(root, bytes(layout['root_secs'] * SECTOR_SIZE))
+        if label:
+            put(root, volume_label(label))
+        f.truncate(card_sectors * SECTOR_SIZE)
+
+    print(f"{filename}: {card_sectors} sectors, partition at {layout['start']}, "
+          f"{layout['total']} sectors of FAT{16 if layout['fat16'] else 12}")
+    print(f"  FAT #1 at {fat1}, FAT #2 at {fat1 + layout['spf']}, {layout['spf']} sectors each")
+    print(f"  root at {root}, {layout['root_entries']} entries")
+    print(f"  data at {layout['data']}, {layout['clusters']} clusters of "
+          f"{layout['cluster']} sectors")
+
+
+def main(argv):
+    size_mb, au_kb, grain_kb, cluster, root_entries, label = 0, AU_KB, GRAIN_KB, CLUSTER_SECTORS, ROOT_ENTRIES, ''
+    files = []
+    args = iter(argv)
+    try:
+        for arg in args:
+            if arg == '-s':
+                size_mb = int(next(args))
+            elif arg == '-a':
+                au_kb = int(next(args))
+            elif arg == '-g':
+                grain_kb = int(next(args))
+            elif arg == '-c':
+                cluster = int(next(args))
+            elif arg == '-r':
+                root_entries = round_up(int(next(args)), SECTOR_SIZE // DIR_ENTRY)
+            elif arg == '-L':
+                label = next(args).upper()
+            else:
+                files.append(arg)
+    except (StopIteration, ValueError):
+        files = []
+    if len(files) != 1 or cluster not in (1, 2, 4, 8, 16, 32, 64):
+        print("Usage: sdformat.py [-s MB] [-a KB] [-g KB] [-c 1..64] [-r entries] [-L label] image")
+        return 2
+    try:
+        format_image(files[0], size_mb, au_kb, grain_kb, cluster, root_entries, label)
+    except (OSError, ValueError) as e:
+        print(f"{files[0]}: {e}")
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
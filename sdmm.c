@@ -33,6 +33,7 @@
 
 #include "diskio.h"     // Common include file for FatFs and disk I/O layer
 #include "cprint.h"
+#include "stats.h"
 
 
 /*-------------------------------------------------------------------------/
@@ -57,6 +58,16 @@ typedef struct {
     uint8_t out_in_reg_a_no_hs;     // out-in reg 'a' NO HANDSHAKE
 } V9kParallelPort;
 
+/* Every access to a 6522 register goes through VIA_RD()/VIA_WR(), so a  */
+/* host build (sim/, SDSIM defined) can put a simulated chip and card    */
+/* behind the port.  For the driver they are plain volatile accesses.    */
+#ifdef SDSIM
+#include "sim/simhost.h"
+#else
+#define VIA_RD(p)      (*(p))
+#define VIA_WR(p, v)   (*(p) = (v))
+#endif
+
 /*-------------------------------------------------------------------------/
 /  Bit definitions for Centronics-style parallel interface, 'via1'.        /
 /-------------------------------------------------------------------------*/ 
@@ -92,15 +103,26 @@ static volatile V9kParallelPort far *via2 = MK_FP(PHASE2_DEVICE_SEGMENT,
 static bool via_initialized;
 extern bool initNeeded;
 extern bool debug;
-const int bit_delay_us = 2;
 
+/* SPI half-bit delay in delay_us() loop counts.  disk_initialize() brings */
+/* the card up at BIT_DELAY_DEFAULT and then calibrates it downwards       */
+/* unless it was fixed with /S=n on the DEVICE= line.                      */
+#define BIT_DELAY_DEFAULT 2
+uint16_t bit_delay_us = BIT_DELAY_DEFAULT;
+bool bit_delay_fixed = false;
 
-#define BITDLY() delay_us(bit_delay_us)
+/* Requested wiring (/W=n) and the backend that survived the probe */
+uint8_t spi_wiring = 0;
+uint8_t spi_backend = 0;
+
+/* delay_us(0) would LOOP 65536 times, so zero must skip the call */
+#define BITDLY() do { if (bit_delay_us) delay_us(bit_delay_us); } while (0)
 
 /*-------------------------------------------------------------------------*/
 /* Platform dependent function to output and input bytes on port           */
 /*-------------------------------------------------------------------------*/
 
+#ifndef SDSIM
 /* something about our makefile isn't letting these be linked, defining here */
 extern void Enable( void );
 #pragma aux Enable = \
@@ -120,6 +142,83 @@ static void delay_us(unsigned int n);
     "loop loopit", \
     parm [ax] \
     modify [cx];
+#endif
+
+#ifdef USE_ASM_SPI
+/*-------------------------------------------------------------------------*/
+/* Receive kernel: ES holds the VIA segment for the whole block, so each   */
+/* bit is two stores to PA (clock high, clock low) and one load from PB.   */
+/* MISO is PB7, so "shl al,1" drops it straight into carry and "rcl ah,1"  */
+/* rotates it into the byte being assembled.  The eight bits of a byte are */
+/* unrolled; a full 512-byte unroll would be ~100K of code, so bytes are   */
+/* counted with LOOP.  Offsets are VIA1 (0x20): PB at 0x20, and PA is      */
+/* written at 0x2F, the no-handshake ORA the C path uses (outportbyte), so */
+/* no store ever pulses CA2.                                               */
+/* BL = MOSIPIN|CLOCKPIN, BH = MOSIPIN (MOSI held high while receiving).   */
+/*-------------------------------------------------------------------------*/
+#define RCVR_BIT \
+    "mov es:[0x2F], bl" \
+    "mov al, es:[0x20]" \
+    "shl al, 1" \
+    "rcl ah, 1" \
+    "mov es:[0x2F], bh"
+
+/*-------------------------------------------------------------------------*/
+/* Transmit kernel: the clock-low value for a bit is just the bit itself   */
+/* (MOSIPIN is PA0), so "shl ah,1 / rcl al,1" into a cleared AL produces   */
+/* it without a branch and "or al,CLOCKPIN" gives the clock-high value.    */
+/* Bytes are fetched with LODSB from DS:SI, PA is addressed through ES.    */
+/*-------------------------------------------------------------------------*/
+#define XMIT_BIT \
+    "xor al, al" \
+    "shl ah, 1" \
+    "rcl al, 1" \
+    "mov es:[0x2F], al" \
+    "or al, 0x02" \
+    "mov es:[0x2F], al"
+
+static void xmit_kernel(const uint8_t far *buff, uint16_t bc);
+#pragma aux xmit_kernel = \
+    "push ds" \
+    "push es" \
+    "pop ds" \
+    "mov ax, 0xE800" \
+    "mov es, ax" \
+    "xmit_byte:" \
+    "lodsb" \
+    "mov ah, al" \
+    XMIT_BIT XMIT_BIT XMIT_BIT XMIT_BIT \
+    XMIT_BIT XMIT_BIT XMIT_BIT XMIT_BIT \
+    "loop xmit_byte" \
+    "mov byte ptr es:[0x2F], 0x01" \
+    "pop ds" \
+    parm [es si] [cx] \
+    modify [ax cx si es];
+
+static void rcvr_kernel(uint8_t far *buff, uint16_t bc);
+#pragma aux rcvr_kernel = \
+    "push ds" \
+    "push es" \
+    "pop ds" \
+    "mov ax, 0xE800" \
+    "mov es, ax" \
+    "mov bx, 0x0103" \
+    "rcvr_byte:" \
+    RCVR_BIT RCVR_BIT RCVR_BIT RCVR_BIT \
+    RCVR_BIT RCVR_BIT RCVR_BIT RCVR_BIT \
+    "mov [di], ah" \
+    "inc di" \
+    "loop rcvr_byte" \
+    "pop ds" \
+    parm [es di] [cx] \
+    modify [ax bx cx di es];
+
+#ifdef SDSIM
+/* The host build runs the instruction text above through sim/asm86.c */
+#define xmit_kernel(buff, bc) sim_asm_kernel("xmit_kernel", (uint8_t *)(buff), (bc))
+#define rcvr_kernel(buff, bc) sim_asm_kernel("rcvr_kernel", (buff), (bc))
+#endif
+#endif
 
 
 void par_port_init(void);
@@ -131,7 +230,7 @@ void outportbyte(volatile uint8_t far* port, uint8_t value) {
          par_port_init();
     }
     //Disable();  /* Disable interrupts */
-    via1->out_in_reg_a = value;
+    VIA_WR(&via1->out_in_reg_a_no_hs, value);  /* No CA2 pulse, see SPI_CA2 */
     //Enable();   /* Enable interrupts */
     //*port = value;
     return;
@@ -140,7 +239,7 @@ void outportbyte(volatile uint8_t far* port, uint8_t value) {
 uint8_t inportbyte(volatile uint8_t far* port) { 
    uint8_t data;
    //Disable();  /* Disable interrupts */
-   data = via1->out_in_reg_b;
+   data = VIA_RD(&via1->out_in_reg_b);
    //Enable();   /* Enable interrupts */
    //cdprintf("inportbyte: data: %x\n", data);
    return data;
@@ -163,23 +262,23 @@ void par_port_init(void) {
    //Via-1 is main parallel port 
    // cdprintf("Address of via1: %x\n", (void*)via1);    
    // cdprintf("via1->out_in_reg_a: %x\n", (void*)via1);          
-   via1->out_in_reg_a = 0;               /* out_in_reg_a is dataport, init with 0's =output bits */ 
+   VIA_WR(&via1->out_in_reg_a, 0);       /* out_in_reg_a is dataport, init with 0's =output bits */ 
    //cdprintf("data_dir_reg_a\n"); 
-   via1->data_dir_reg_a = 0xFF;          /* register a is all outbound, 1111 = all bits outgoing */
+   VIA_WR(&via1->data_dir_reg_a, 0xFF);  /* register a is all outbound, 1111 = all bits outgoing */
    //cdprintf("out_in_reg_b\n"); 
-   via1->out_in_reg_b = 0;               /* out_in_reg_b is input, clear register                */
+   VIA_WR(&via1->out_in_reg_b, 0);       /* out_in_reg_b is input, clear register                */
    //cdprintf("data_dir_reg_b\n"); 
-   via1->data_dir_reg_b = 0x00;             /* register b is all inbound, init with 0000's             */
+   VIA_WR(&via1->data_dir_reg_b, 0x00);     /* register b is all inbound, init with 0000's             */
    //cdprintf("periph_ctrl_reg\n"); 
-   via1->periph_ctrl_reg = 0x00;            /* setting incoming usage of CA1/CA2 lines              */
+   VIA_WR(&via1->periph_ctrl_reg, 0x00);    /* setting incoming usage of CA1/CA2 lines              */
    //via1->aux_ctrl_reg = 0x00;             /* turn off the timer / shift registers / etc.       */
 
    //Via-2 PB1 controls talk-enable line
    // cdprintf("Address of via2: %x\n", (void*)via2);
    // cdprintf("via2 talk enable output\n"); 
-   via2->data_dir_reg_b |= TALK_ENABLE_H;                /* set talk-enable pin to output mode   */
+   VIA_WR(&via2->data_dir_reg_b, VIA_RD(&via2->data_dir_reg_b) | TALK_ENABLE_H); /* set talk-enable pin to output mode   */
    //cdprintf("via2 talk enable true\n"); 
-   via2->out_in_reg_b |= TALK_ENABLE_H;                  /* set talk-enable pin value to true    */
+   VIA_WR(&via2->out_in_reg_b, VIA_RD(&via2->out_in_reg_b) | TALK_ENABLE_H);     /* set talk-enable pin value to true    */
    //cdprintf("about to return init()\n"); 
    OUTPORT=&via1->out_in_reg_a;
    STATUSPORT=&via1->out_in_reg_b;
@@ -233,6 +332,41 @@ void par_port_init(void) {
 #define CSPIN       (0x01 << 2)
 /* Connect ground to one of PPORT pins 18-25 */
 
+/* Optional shift-register wiring (/W=1): the 6522 clocks bytes in by      */
+/* itself.  CB2 also goes to the card's DO and SCLK becomes PA1 AND CB1    */
+/* (74HC08, pull-up on CB1), so bit-banging still works while CB1 idles    */
+/* high and the shift register clocks the card while PA1 is held high.     */
+/* Bits are latched on the rising edge of CB1, one bit per two phi2 clocks.*/
+#define ACR_SR_MASK    0x1C  /* ACR bits 4..2: shift register mode */
+#define ACR_SR_IN_PHI2 0x08  /* 010: shift in under phi2 control */
+#define IFR_SR         0x04  /* IFR bit 2: 8 bits shifted */
+
+/* Optional CA2 wiring (/W=2): SCLK comes from CA2 instead of PA1.  With  */
+/* the PCR in pulse-output mode the 6522 drops CA2 for one phi2 cycle      */
+/* after every write to ORA, so one port write is one clock.  SCLK idles   */
+/* high and the card samples MOSI on the rising edge that ends each pulse, */
+/* which makes this SPI mode 3 (CPOL=1, CPHA=1), not the mode 0 that the   */
+/* PA1 bit-banging uses.  SD cards are meant to accept both, but a card    */
+/* that only does mode 0 will not come up on this wiring.  PA writes that  */
+/* must not clock go through the no-handshake ORA (out_in_reg_a_no_hs).    */
+/* If bring-up fails under CA2, disk_initialize() retries by bit-banging   */
+/* PA1.  That only helps when /W=2 was given but SCLK is in fact still on  */
+/* PA1; with SCLK really on CA2, PA1 clocks nothing and the card stays     */
+/* down, so a mode-0-only card needs the PA1 wiring (/W=0 or /W=1).        */
+#define PCR_CA2_PULSE  0x0A  /* PCR bits 3..1 = 101: CA2 pulse output */
+
+/* VIA1 timer 2 is free for use as a stopwatch: one-shot mode, counting */
+/* down from 0xFFFF at the VIA clock.  IFR bit 5 is set once it passes 0. */
+#define ACR_T2_PULSES  0x20  /* ACR bit 5: T2 counts PB6 pulses (we want 0) */
+#define IFR_T2         0x20  /* IFR bit 5: T2 reached zero */
+
+#ifdef USE_ASM_SPI
+#if (PHASE2_DEVICE_SEGMENT != 0xE800) || (VIA1_REG_OFFSET != 0x0020) || \
+    (MOSIPIN != 0x01) || (CLOCKPIN != 0x02) || (MISOPIN != 0x80)
+#error "rcvr_kernel/xmit_kernel hardcode the VIA1 address and the SPI pins"
+#endif
+#endif
+
 #if 1
 #define TOUTCHR(x)
 #define TOUTHEX(x) 
@@ -281,6 +415,33 @@ void setportbase(uint8_t val)
 
 
 
+/* via_timer_start */
+/*   Restart VIA1 timer 2 from 0xFFFF.  Writing the high byte loads the  */
+/* counter and clears the IFR flag.                                      */
+void via_timer_start (void)
+{
+   VIA_WR(&via1->aux_ctrl_reg, VIA_RD(&via1->aux_ctrl_reg) & ~ACR_T2_PULSES);
+   VIA_WR(&via1->timer2_ctr_lo, 0xFF);
+   VIA_WR(&via1->timer2_ctr_hi, 0xFF);
+}
+
+/* via_timer_elapsed */
+/*   VIA clock ticks since via_timer_start(), 0xFFFF once it has run out. */
+/* The high byte is read on both sides of the low one in case the low   */
+/* byte wrapped in between.                                              */
+uint16_t via_timer_elapsed (void)
+{
+   uint8_t hi, lo;
+
+   if (VIA_RD(&via1->int_flag_reg) & IFR_T2) return 0xFFFF;
+   do {
+      hi = VIA_RD(&via1->timer2_ctr_hi);
+      lo = VIA_RD(&via1->timer2_ctr_lo);
+   } while (hi != VIA_RD(&via1->timer2_ctr_hi));
+   return 0xFFFF - (((uint16_t)hi << 8) | lo);
+}
+
+
 #define DO(statusport) (inportbyte((statusport)) & MISOPIN)  
 #define CDDETECT(statusport) (1)
 #define CLOCKBITHIGHMOSIHIGH(outport) outportbyte((outport),MOSIPIN|CLOCKPIN) 
@@ -372,6 +533,7 @@ uint32_t dwordrshift(uint32_t d, int n)
 #define CMD32  (32)     /* ERASE_ER_BLK_START */
 #define CMD33  (33)     /* ERASE_ER_BLK_END */
 #define CMD38  (38)     /* ERASE */
+#define ACMD51 (0x80+51)   /* SEND_SCR (SDC) */
 #define CMD55  (55)     /* APP_CMD */
 #define CMD58  (58)     /* READ_OCR */
 
@@ -382,14 +544,26 @@ DSTATUS Stat = STA_NOINIT; /* Disk status */
 static
 uint8_t CardType;       /* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
 
+static
+bool CardCmd23;         /* SCR says the card takes CMD23 SET_BLOCK_COUNT */
+uint16_t data_blocks;   /* Sector data packets, either way, for latencyRecord() */
+
 
 
 /*-----------------------------------------------------------------------*/
 /* Transmit bytes to the card (bitbanging)                               */
 /*-----------------------------------------------------------------------*/
 
+/* PA values for each MOSI level, clock low and clock high */
+static const uint8_t xmit_clk_lo[2] = { 0, MOSIPIN };
+static const uint8_t xmit_clk_hi[2] = { CLOCKPIN, MOSIPIN|CLOCKPIN };
+
+#define CLOCK_OUT_BIT(d, n) \
+   VIA_WR(outport, xmit_clk_lo[((d) >> (n)) & 1]); BITDLY(); \
+   VIA_WR(outport, xmit_clk_hi[((d) >> (n)) & 1]); BITDLY();
+
 static
-void xmit_mmc (
+void xmit_bitbang (
    const uint8_t far * buff, /* Data to be sent */
    uint16_t bc                  /* Number of bytes to send */
 )
@@ -399,50 +573,41 @@ void xmit_mmc (
 
    do {
       d = *buff++;   /* Get a byte to be sent */
-      if (d & 0x80) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x40) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x20) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x10) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x08) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x04) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x02) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
-      if (d & 0x01) 
-      {  CLOCKBITLOWMOSIHIGH(outport); BITDLY(); CLOCKBITHIGHMOSIHIGH(outport); BITDLY();
-      } else
-      {  CLOCKBITLOWMOSILOW(outport); BITDLY(); CLOCKBITHIGHMOSILOW(outport); BITDLY();
-      } 
+      CLOCK_OUT_BIT(d, 7) CLOCK_OUT_BIT(d, 6) CLOCK_OUT_BIT(d, 5) CLOCK_OUT_BIT(d, 4)
+      CLOCK_OUT_BIT(d, 3) CLOCK_OUT_BIT(d, 2) CLOCK_OUT_BIT(d, 1) CLOCK_OUT_BIT(d, 0)
    } while (--bc);
    CLOCKBITLOWMOSIHIGH(outport);
 }
 
+static void xmit_ca2 (const uint8_t far *buff, uint16_t bc);
+
+static
+void xmit_mmc (
+   const uint8_t far * buff, /* Data to be sent */
+   uint16_t bc                  /* Number of bytes to send */
+)
+{
+   if (spi_backend == SPI_CA2) {
+      xmit_ca2(buff, bc);
+      return;
+   }
+#ifdef USE_ASM_SPI
+   if (!bit_delay_us) {       /* The kernel runs at full CPU speed */
+      xmit_kernel(buff, bc);
+      return;
+   }
+#endif
+   xmit_bitbang(buff, bc);
+}
+
+#ifdef SDSIM
+/* sdbench times the transmit paths on their own through this */
+void sim_xmit_mmc (const uint8_t far *buff, uint16_t bc)
+{
+   xmit_mmc(buff, bc);
+}
+#endif
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -450,7 +615,7 @@ void xmit_mmc (
 /*-----------------------------------------------------------------------*/
 
 static
-void rcvr_mmc (
+void rcvr_bitbang (
    uint8_t far *buff, /* Pointer to read buffer */
    uint16_t bc            /* Number of bytes to receive */
 )
@@ -496,6 +661,127 @@ void rcvr_mmc (
    } while (--bc);
 }
 
+/*-----------------------------------------------------------------------*/
+/* Receive bytes from the card (VIA shift register)                      */
+/*-----------------------------------------------------------------------*/
+
+/* In shift-in mode every read of the shift register starts the next     */
+/* 8 clocks, so the byte just read is stored while the VIA is already    */
+/* shifting the following one.  The mode is switched off before the last */
+/* read so no extra byte is clocked out of the card.                     */
+/*                                                                       */
+/* CB1 idles high, so raising PA1 to hand SCLK over is itself a rising   */
+/* edge: it clocks bit 7 of the first byte, which is read from PB7.  The */
+/* shift register is then always one bit ahead, each read giving bits    */
+/* 6..0 of one byte and bit 7 of the next, and the last byte's remaining */
+/* seven bits are bit-banged so the card sees exactly 8 clocks a byte.   */
+static
+void rcvr_shiftreg (
+   uint8_t far *buff, /* Pointer to read buffer */
+   uint16_t bc            /* Number of bytes to receive */
+)
+{
+   volatile V9kParallelPort far *via = via1;
+   uint8_t acr = VIA_RD(&via->aux_ctrl_reg) & ~ACR_SR_MASK;
+   uint8_t r, hi, n;
+
+   VIA_WR(&via->out_in_reg_a, MOSIPIN|CLOCKPIN);  /* Hand SCLK to CB1, MOSI high */
+   hi = VIA_RD(&via->out_in_reg_b) & MISOPIN;     /* Bit 7 of the first byte */
+   if (--bc) {
+      VIA_WR(&via->aux_ctrl_reg, acr | ACR_SR_IN_PHI2);
+      (void)VIA_RD(&via->shift_reg);         /* Start the first byte */
+      while (--bc) {
+         while (!(VIA_RD(&via->int_flag_reg) & IFR_SR)) ;
+         r = VIA_RD(&via->shift_reg);        /* Store byte n, shift byte n+1 */
+         *buff++ = hi | (r >> 1);
+         hi = r << 7;
+      }
+      while (!(VIA_RD(&via->int_flag_reg) & IFR_SR)) ;
+      VIA_WR(&via->aux_ctrl_reg, acr);
+      r = VIA_RD(&via->shift_reg);
+      *buff++ = hi | (r >> 1);
+      hi = r << 7;
+   }
+   r = hi >> 7;
+   for (n = 7; n; n--) {
+      VIA_WR(&via->out_in_reg_a, MOSIPIN); BITDLY();
+      VIA_WR(&via->out_in_reg_a, MOSIPIN|CLOCKPIN); BITDLY();
+      r <<= 1; if (VIA_RD(&via->out_in_reg_b) & MISOPIN) r++;
+   }
+   *buff = r;
+   VIA_WR(&via->out_in_reg_a, MOSIPIN);   /* SCLK back to PA1, low */
+}
+
+/*-----------------------------------------------------------------------*/
+/* Transmit/receive bytes with SCLK pulsed from CA2                      */
+/*-----------------------------------------------------------------------*/
+
+#define CA2_OUT_BIT(d, n) \
+   VIA_WR(&via->out_in_reg_a, xmit_clk_lo[((d) >> (n)) & 1]);
+
+static
+void xmit_ca2 (
+   const uint8_t far * buff, /* Data to be sent */
+   uint16_t bc                  /* Number of bytes to send */
+)
+{
+   volatile V9kParallelPort far *via = via1;
+   uint8_t d;
+
+   do {
+      d = *buff++;   /* Get a byte to be sent */
+      CA2_OUT_BIT(d, 7) CA2_OUT_BIT(d, 6) CA2_OUT_BIT(d, 5) CA2_OUT_BIT(d, 4)
+      CA2_OUT_BIT(d, 3) CA2_OUT_BIT(d, 2) CA2_OUT_BIT(d, 1) CA2_OUT_BIT(d, 0)
+   } while (--bc);
+   VIA_WR(&via->out_in_reg_a_no_hs, MOSIPIN);
+}
+
+/* The pulse has ended by the time PB is read, so DO already holds the   */
+/* bit the card shifted out on this pulse's falling edge.                */
+#define CA2_IN_BIT(r) \
+   VIA_WR(&via->out_in_reg_a, MOSIPIN); \
+   r <<= 1; if (VIA_RD(&via->out_in_reg_b) & MISOPIN) r++;
+
+static
+void rcvr_ca2 (
+   uint8_t far *buff, /* Pointer to read buffer */
+   uint16_t bc            /* Number of bytes to receive */
+)
+{
+   volatile V9kParallelPort far *via = via1;
+   uint8_t r;
+
+   do {
+      r = 0;
+      CA2_IN_BIT(r) CA2_IN_BIT(r) CA2_IN_BIT(r) CA2_IN_BIT(r)
+      CA2_IN_BIT(r) CA2_IN_BIT(r) CA2_IN_BIT(r) CA2_IN_BIT(r)
+      *buff++ = r;         /* Store a received byte */
+   } while (--bc);
+}
+
+static
+void rcvr_mmc (
+   uint8_t far *buff, /* Pointer to read buffer */
+   uint16_t bc            /* Number of bytes to receive */
+)
+{
+   if (spi_backend == SPI_CA2) {
+      rcvr_ca2(buff, bc);
+      return;
+   }
+   if (spi_backend == SPI_SHIFTREG) {
+      rcvr_shiftreg(buff, bc);
+      return;
+   }
+#ifdef USE_ASM_SPI
+   if (!bit_delay_us) {       /* The kernel runs at full CPU speed */
+      rcvr_kernel(buff, bc);
+      return;
+   }
+#endif
+   rcvr_bitbang(buff, bc);
+}
+
 /*-----------------------------------------------------------------------*/
 /* Receive bytes from the card (bitbanging)                              */
 /*-----------------------------------------------------------------------*/
@@ -506,6 +792,10 @@ void dummy_rcvr_mmc (void)
    int i;
    volatile uint8_t far *outport = OUTPORT;
    CLOCKBITLOWMOSIHIGHNOCS(outport); BITDLY();
+   if (spi_backend == SPI_CA2) {
+      for (i=0;i<8;i++) VIA_WR(&via1->out_in_reg_a, MOSIPIN|CSPIN);
+      return;
+   }
    for (i=0;i<8;i++)
    {
       CLOCKBITHIGHMOSIHIGHNOCS(outport); BITDLY();
@@ -529,6 +819,7 @@ int wait_ready (void)   /* 1:OK, 0:Timeout */
       if (d == 0xFF) break;
       delay_us(100);
    }
+   STAT_ADD(st_ready_spins, 5000 - tmr);
 
    return tmr ? 1 : 0;
 }
@@ -554,6 +845,11 @@ void deselect (void)
 /* Select the card and wait for ready                                    */
 /*-----------------------------------------------------------------------*/
 
+/* Set when the card was left programming: after a CMD24 data packet or  */
+/* the stop token of a CMD25.  The next select() that finds the card     */
+/* ready clears it, so disk_flush() knows whether it still has to wait.  */
+static bool WritePending;
+
 static
 int select (void) /* 1:OK, 0:Timeout */
 {
@@ -562,7 +858,10 @@ int select (void) /* 1:OK, 0:Timeout */
    CS_L(OUTPORT); 
    rcvr_mmc(&d, 1);  /* Dummy clock (force DO enabled) */
 
-   if (wait_ready()) return 1;   /* OK */
+   if (wait_ready()) {
+      WritePending = false;
+      return 1;      /* OK */
+   }
    deselect();
    return 0;         /* Failed */
 }
@@ -588,12 +887,14 @@ int rcvr_datablock ( /* 1:OK, 0:Failed */
       if (d[0] != 0xFF) break;
       delay_us(100);
    }
+   STAT_ADD(st_token_spins, 1000 - tmr);
    if (d[0] != 0xFE) {
     return 0;      /* If not valid data token, return with error */
    }
 
    rcvr_mmc(buff, btr);       /* Receive the data block into buffer */
    rcvr_mmc(d, 2);               /* Discard CRC */
+   if (btr == 512) data_blocks++;
 
    return 1;                  /* Return with success */
 }
@@ -625,6 +926,7 @@ int xmit_datablock ( /* 1:OK, 0:Failed */
       {
          return 0;
       }
+      data_blocks++;
    }
 
    return 1;
@@ -674,6 +976,9 @@ uint8_t send_cmd (      /* Returns command response (bit7==1:Send failed)*/
    if (cmd == CMD0) n = 0x95;    /* (valid CRC for CMD0(0)) */
    if (cmd == CMD8) n = 0x87;    /* (valid CRC for CMD8(0x1AA)) */
    buf[5] = n;
+   if (cmd == CMD12) STAT_INC(st_cmd12);
+   else if (cmd == CMD17 || cmd == CMD24) STAT_INC(st_single_cmds);
+   else if (cmd == CMD18 || cmd == CMD25) STAT_INC(st_multi_cmds);
    TOUTCHR('L');
    TOUTHEX(buf[0]);
    TOUTHEX(buf[1]);
@@ -698,6 +1003,59 @@ uint8_t send_cmd (      /* Returns command response (bit7==1:Send failed)*/
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Open multi-block transfers kept across DOS requests                   */
+/*-----------------------------------------------------------------------*/
+
+/* A CMD18 is left running (CS low) after a read so that the next DOS    */
+/* request, which is very often for the following LBA, can go straight   */
+/* on receiving data packets.  Writes do the same with CMD25: contiguous */
+/* sectors are appended as further 0xFC data packets.  Any other access  */
+/* to the card has to call stop_stream() first.                          */
+/*                                                                       */
+/* Safety rules for the open write stream:                               */
+/*  - A write is reported done to DOS only after the card has answered   */
+/*    every one of its data packets with "data accepted".                */
+/*  - The stream is closed with the stop token before any read, any      */
+/*    non-contiguous write, every media check, IOCTL and an explicit    */
+/*    sd_sync()/sd_flush()/sd_stop().  Closing does not wait for the     */
+/*    card to finish programming: like after a CMD24, that busy time is  */
+/*    absorbed by the wait_ready() in the next select(), and DOS gets    */
+/*    on with its own work meanwhile.  Only sd_sync()/sd_flush() wait.   */
+/*  - DOS writes file data before the FAT and directory sectors that     */
+/*    point at it, and those are never contiguous with the data, so a    */
+/*    file's data stream is always closed before its metadata lands.     */
+/*  - Until the stream is closed the card may still be programming the   */
+/*    last sector; pulling the card or power at that moment can lose it. */
+#define STREAM_NONE  0
+#define STREAM_READ  1     /* CMD18 open, next data packet is StreamNext */
+#define STREAM_WRITE 2     /* CMD25 open, next data packet is StreamNext */
+
+static uint8_t Stream = STREAM_NONE;
+static uint32_t StreamNext;   /* LBA the open transfer will deliver next */
+static uint32_t LastReadEnd;  /* LBA following the last sector read */
+static uint32_t LastWriteEnd; /* LBA following the last sector written */
+
+static
+int stop_stream (void)  /* 1:OK, 0:Failed to close a write stream */
+{
+   int ok = 1;
+
+   if (Stream == STREAM_READ) {
+      send_cmd(CMD12, 0);           /* STOP_TRANSMISSION */
+      deselect();
+   }
+   else if (Stream == STREAM_WRITE) {
+      if (!xmit_datablock(0, 0xFD)) ok = 0; /* STOP_TRAN token */
+      deselect();                           /* Busy is left to next select() */
+      WritePending = true;
+   }
+   Stream = STREAM_NONE;
+   return ok;
+}
+
+
+
 /*--------------------------------------------------------------------------
 
    Public Functions
@@ -737,31 +1095,83 @@ DRESULT disk_result (
 
 
 /*-----------------------------------------------------------------------*/
-/* Initialize Disk Drive                                                 */
+/* Calibrate the SPI bit delay                                           */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (uint8_t drv)
+#define CAL_SECTOR 0       /* MBR or boot sector, always present */
+#define CAL_PASSES 4       /* Error-free reads required per setting */
+
+static
+uint16_t cal_checksum (const uint8_t *buff)
 {
-   /* drv = Physical drive nmuber (0) */
-   uint8_t n, card_type, cmd, buf[4];
-   uint16_t tmr;
-   DSTATUS s;
+   uint16_t i, sum = 0;
 
-   if (debug) {
-      cdprintf ("disk_initialize: before setportbase(), drv: %x\n", drv);
-      cdprintf ("disk_initialize: before setportbase(), portbase: %x\n", portbase);
+   for (i = 0; i < 512; i++)
+      sum = ((sum << 1) | (sum >> 15)) + buff[i];
+   return sum;
+}
+
+/* Read CAL_SECTOR at the current setting and at every shorter delay. A  */
+/* setting is kept only if every pass gets a data token (rcvr_datablock) */
+/* and the same checksum as the reference read at the starting delay.    */
+static
+void calibrate_spi (void)
+{
+   uint8_t buf[512];
+   uint16_t ref, best, n;
+
+   best = bit_delay_us;
+   if (disk_read(0, buf, CAL_SECTOR, 1) != RES_OK) return;
+   ref = cal_checksum(buf);
+
+   while (bit_delay_us) {
+      bit_delay_us--;
+      for (n = CAL_PASSES; n; n--) {
+         if (disk_read(0, buf, CAL_SECTOR, 1) != RES_OK) break;
+         if (cal_checksum(buf) != ref) break;
+      }
+      if (n) break;           /* This setting failed, keep the last good one */
+      best = bit_delay_us;
    }
-   setportbase(portbase);
+   bit_delay_us = best;
+   stop_stream();
+   if (debug) cdprintf ("calibrate_spi: bit delay: %d\n", bit_delay_us);
+}
 
-   if (debug) cdprintf ("disk_initialize: if (drv) return: %x\n", drv);
-   if (drv) return RES_NOTRDY;
-   
-   if (debug) cdprintf ("disk_initialize: if sd_card_check: %x CDDETECT(STATUSPORT): %x \n", 
-      sd_card_check, CDDETECT(STATUSPORT));
-   if ((sd_card_check) && (CDDETECT(STATUSPORT))){
-      return RES_NOTRDY;
+/* Switch receive to the shift register and keep it only if it returns   */
+/* the same sector as bit-banging, CAL_PASSES times in a row.            */
+static
+void probe_shiftreg (void)
+{
+   uint8_t buf[512];
+   uint16_t ref, n;
+
+   if (disk_read(0, buf, CAL_SECTOR, 1) != RES_OK) return;
+   ref = cal_checksum(buf);
+
+   spi_backend = SPI_SHIFTREG;
+   for (n = CAL_PASSES; n; n--) {
+      if (disk_read(0, buf, CAL_SECTOR, 1) != RES_OK) break;
+      if (cal_checksum(buf) != ref) break;
    }
-   
+   if (n) spi_backend = SPI_BITBANG;    /* Not wired, stay on bit-banging */
+   stop_stream();
+   if (debug) cdprintf ("probe_shiftreg: backend: %d\n", spi_backend);
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Initialize Disk Drive                                                 */
+/*-----------------------------------------------------------------------*/
+
+/* Power-up sequence and card identification, returns the card type     */
+/* (0 if no card answered)                                               */
+static
+uint8_t bringup_card (void)
+{
+   uint8_t n, card_type, cmd, buf[4];
+   uint16_t tmr;
+
    card_type = 0;
    for (n = 5; n; n--) {
       if (debug) cdprintf ("disk_initialize: for: %x\n", n);
@@ -804,6 +1214,61 @@ DSTATUS disk_initialize (uint8_t drv)
          break;
       }
    }
+   return card_type;
+}
+
+/* Read the SCR and note whether the card supports CMD23. CMD_SUPPORT  */
+/* is SCR bits 33:32, bit 33 (byte 3, bit 1) being SET_BLOCK_COUNT.     */
+static
+void probe_cmd23 (void)
+{
+   uint8_t scr[8];
+
+   CardCmd23 = false;
+   if (CardType & CT_SDC) {
+      if (send_cmd(ACMD51, 0) == 0 && rcvr_datablock(scr, 8))
+         CardCmd23 = (scr[3] & 0x02) ? true : false;
+      deselect();
+   }
+   if (debug) cdprintf ("disk_initialize: CMD23: %x\n", CardCmd23);
+}
+
+DSTATUS disk_initialize (uint8_t drv)
+{
+   /* drv = Physical drive nmuber (0) */
+   uint8_t card_type;
+   DSTATUS s;
+
+   if (debug) {
+      cdprintf ("disk_initialize: before setportbase(), drv: %x\n", drv);
+      cdprintf ("disk_initialize: before setportbase(), portbase: %x\n", portbase);
+   }
+   setportbase(portbase);
+   STAT_INC(st_reinits);
+
+   if (debug) cdprintf ("disk_initialize: if (drv) return: %x\n", drv);
+   if (drv) return RES_NOTRDY;
+   
+   if (debug) cdprintf ("disk_initialize: if sd_card_check: %x CDDETECT(STATUSPORT): %x \n", 
+      sd_card_check, CDDETECT(STATUSPORT));
+   if ((sd_card_check) && (CDDETECT(STATUSPORT))){
+      return RES_NOTRDY;
+   }
+   
+   Stream = STREAM_NONE;            /* Anything open is lost on re-init */
+   WritePending = false;
+   LastReadEnd = LastWriteEnd = 0xFFFFFFFFUL;
+   if (!bit_delay_fixed) bit_delay_us = BIT_DELAY_DEFAULT;  /* Bring-up speed */
+   /* Card init needs a slow, CPU-driven clock: bit-banging or CA2 pulses */
+
+   spi_backend = (spi_wiring == SPI_CA2) ? SPI_CA2 : SPI_BITBANG;
+   VIA_WR(&via1->periph_ctrl_reg, (spi_backend == SPI_CA2) ? PCR_CA2_PULSE : 0x00);
+   card_type = bringup_card();
+   if (!card_type && spi_backend == SPI_CA2) {   /* SCLK still on PA1? */
+      spi_backend = SPI_BITBANG;
+      VIA_WR(&via1->periph_ctrl_reg, 0x00);
+      card_type = bringup_card();
+   }
    CardType = card_type;
    if (debug) cdprintf ("disk_initialize: CardType: %x\n", CardType);
    s = card_type ? 0 : STA_NOINIT;
@@ -811,6 +1276,11 @@ DSTATUS disk_initialize (uint8_t drv)
    if (debug) cdprintf ("disk_initialize: Stat: %x\n", Stat);
    deselect();
 
+   CardCmd23 = false;
+   if (card_type) probe_cmd23();
+   if (card_type && spi_backend == SPI_BITBANG && !bit_delay_fixed) calibrate_spi();
+   if (card_type && spi_wiring == SPI_SHIFTREG) probe_shiftreg();
+
    return s;
 }
 
@@ -824,31 +1294,103 @@ DRESULT disk_read (
    uint8_t drv,            /* Physical drive nmuber (0) */
    uint8_t far *buff,   /* Pointer to the data buffer to store read data */
    uint32_t sector,        /* Start sector number (LBA) */
-   uint16_t count           /* Sector count (1..128) */
+   uint16_t count           /* Sector count (1..65535) */
 )
 {
+   uint32_t addr;
    DRESULT dr = disk_result(drv);
    if (dr != RES_OK) return dr;
-   
-   if (!(CardType & CT_BLOCK)) sector = uint32_tLSHIFT(sector,9);   /* Convert LBA to byte address if needed */
 
-   if (count == 1) { /* Single block read */
-      if ((send_cmd(CMD17, sector) == 0)  /* READ_SINGLE_BLOCK */
-         && rcvr_datablock(buff, 512))
-         count = 0;
+   if (Stream == STREAM_READ && sector == StreamNext) {
+      /* Continue the open CMD18, no command needed */
    }
-   else {            /* Multiple block read */
-      if (send_cmd(CMD18, sector) == 0) { /* READ_MULTIPLE_BLOCK */
+   else {
+      stop_stream();
+      addr = sector;
+      if (!(CardType & CT_BLOCK)) addr = uint32_tLSHIFT(addr,9);   /* Convert LBA to byte address if needed */
+
+      if (count == 1 && sector != LastReadEnd) { /* Isolated single block read */
+         if ((send_cmd(CMD17, addr) == 0)  /* READ_SINGLE_BLOCK */
+            && rcvr_datablock(buff, 512))
+            count = 0;
+         deselect();
+         LastReadEnd = sector + 1;
+         return count ? RES_ERROR : RES_OK;
+      }
+      if (CardCmd23 && sector != LastReadEnd) {
+         /* Not following on from the last read, so the next request is */
+         /* unlikely to continue this one: pre-declare the length and   */
+         /* let the card stop by itself instead of paying for CMD12.    */
+         if (send_cmd(CMD23, count) != 0      /* SET_BLOCK_COUNT */
+            || send_cmd(CMD18, addr) != 0) {  /* READ_MULTIPLE_BLOCK */
+            deselect();
+            return RES_ERROR;
+         }
+         StreamNext = sector;
          do {
             if (!rcvr_datablock(buff, 512)) break;
-            buff += 512;
+            NEXT_SECTOR(buff);
+            StreamNext++;
          } while (--count);
-         send_cmd(CMD12, 0);           /* STOP_TRANSMISSION */
+         LastReadEnd = StreamNext;
+         if (count) {                /* Abort the rest of the counted read */
+            Stream = STREAM_READ;
+            stop_stream();
+            return RES_ERROR;
+         }
+         deselect();
+         return RES_OK;
+      }
+      if (send_cmd(CMD18, addr) != 0) { /* READ_MULTIPLE_BLOCK */
+         deselect();
+         return RES_ERROR;
       }
+      Stream = STREAM_READ;
+      StreamNext = sector;
    }
-   deselect();
 
-   return count ? RES_ERROR : RES_OK;
+   do {
+      if (!rcvr_datablock(buff, 512)) break;
+      NEXT_SECTOR(buff);
+      StreamNext++;
+   } while (--count);
+   LastReadEnd = StreamNext;
+
+   if (count) {                   /* Failed, do not leave the card streaming */
+      stop_stream();
+      return RES_ERROR;
+   }
+   return RES_OK;                 /* CMD18 stays open for the next request */
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Open a read stream ahead of a run of single-sector reads              */
+/*-----------------------------------------------------------------------*/
+
+/* The read side of disk_write_begin(): a caller that reads sector,      */
+/* sector+1, ... one disk_read() at a time into scattered buffers opens  */
+/* the CMD18 here, so the run costs one command instead of a CMD17 and   */
+/* then a CMD18 for the rest.                                            */
+DRESULT disk_read_begin (
+   uint8_t drv,             /* Physical drive nmuber (0) */
+   uint32_t sector          /* First sector of the run (LBA) */
+)
+{
+   uint32_t addr = sector;
+   DRESULT dr = disk_result(drv);
+   if (dr != RES_OK) return dr;
+
+   if (Stream == STREAM_READ && sector == StreamNext) return RES_OK;
+   if (!stop_stream()) return RES_ERROR;
+   if (!(CardType & CT_BLOCK)) addr = uint32_tLSHIFT(addr,9);   /* Convert LBA to byte address if needed */
+   if (send_cmd(CMD18, addr) != 0) { /* READ_MULTIPLE_BLOCK */
+      deselect();
+      return RES_ERROR;
+   }
+   Stream = STREAM_READ;
+   StreamNext = sector;
+   return RES_OK;
 }
 
 
@@ -857,38 +1399,138 @@ DRESULT disk_read (
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
 
+/* Issue a CMD25 at sector and leave it open as the write stream */
+static
+int open_write_stream (  /* 1:OK, 0:Failed */
+   uint32_t sector
+)
+{
+   uint32_t addr = sector;
+
+   if (!(CardType & CT_BLOCK)) addr = uint32_tLSHIFT(addr,9);   /* Convert LBA to byte address if needed */
+   /* No ACMD23 pre-erase count: the length of an open stream is unknown */
+   if (send_cmd(CMD25, addr) != 0) { /* WRITE_MULTIPLE_BLOCK */
+      deselect();
+      return 0;
+   }
+   Stream = STREAM_WRITE;
+   StreamNext = sector;
+   return 1;
+}
+
 DRESULT disk_write (
    uint8_t drv,                /* Physical drive nmuber (0) */
    const uint8_t far *buff, /* Pointer to the data to be written */
    uint32_t sector,            /* Start sector number (LBA) */
-   uint16_t count               /* Sector count (1..128) */
+   uint16_t count               /* Sector count (1..65535) */
 )
 {
+   uint32_t addr;
    DRESULT dr = disk_result(drv);
    if (dr != RES_OK) return dr;
 
-   if (!(CardType & CT_BLOCK)) sector = uint32_tLSHIFT(sector,9);   /* Convert LBA to byte address if needed */
-   
-   if (count == 1) { /* Single block write */
-      if ((send_cmd(CMD24, sector) == 0)  /* WRITE_BLOCK */
-         && xmit_datablock(buff, 0xFE))
-         count = 0;
-   }
-   else {            /* Multiple block write */
-      if (CardType & CT_SDC) send_cmd(ACMD23, count); 
-      if (send_cmd(CMD25, sector) == 0) { /* WRITE_MULTIPLE_BLOCK */
-         do {
-            if (!xmit_datablock(buff, 0xFC)) break;
-            buff += 512;
-         } while (--count);
-         if (!xmit_datablock(0, 0xFD)) /* STOP_TRAN token */
-            count = 1;
-         if (!wait_ready()) count = 1;   /* Wait for card to write */
+   if (Stream == STREAM_WRITE && sector == StreamNext) {
+      /* Append to the open CMD25, no command needed */
+   }
+   else {
+      if (!stop_stream()) return RES_ERROR;
+      addr = sector;
+      if (!(CardType & CT_BLOCK)) addr = uint32_tLSHIFT(addr,9);   /* Convert LBA to byte address if needed */
+
+      if (count == 1 && sector != LastWriteEnd) { /* Isolated single block write */
+         if ((send_cmd(CMD24, addr) == 0)  /* WRITE_BLOCK */
+            && xmit_datablock(buff, 0xFE))
+            count = 0;
+         deselect();
+         WritePending = true;            /* Busy is left to next select() */
+         LastWriteEnd = sector + 1;
+         return count ? RES_ERROR : RES_OK;
       }
+      if (!open_write_stream(sector)) return RES_ERROR;
+   }
+
+   do {
+      if (!xmit_datablock(buff, 0xFC)) break;
+      NEXT_SECTOR(buff);
+      StreamNext++;
+   } while (--count);
+   LastWriteEnd = StreamNext;
+
+   if (count) {                   /* Rejected or timed out, close it */
+      stop_stream();
+      return RES_ERROR;
    }
+   return RES_OK;                 /* CMD25 stays open for the next request */
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Open a write stream ahead of a run of single-sector writes            */
+/*-----------------------------------------------------------------------*/
+
+/* A caller that is about to write sector, sector+1, ... one disk_write()*/
+/* at a time from scattered buffers opens the CMD25 here first, so the   */
+/* first sector is not sent as an isolated CMD24.                        */
+DRESULT disk_write_begin (
+   uint8_t drv,             /* Physical drive nmuber (0) */
+   uint32_t sector          /* First sector of the run (LBA) */
+)
+{
+   DRESULT dr = disk_result(drv);
+   if (dr != RES_OK) return dr;
+
+   if (Stream == STREAM_WRITE && sector == StreamNext) return RES_OK;
+   if (!stop_stream()) return RES_ERROR;
+   return open_write_stream(sector) ? RES_OK : RES_ERROR;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Close an open stream without waiting for the card to finish          */
+/*-----------------------------------------------------------------------*/
+
+/* The STOP_TRAN token still waits for the last block to be taken, but  */
+/* the programming after it is left to the next select(), as for a      */
+/* stream closed by the next command.  For callers on a time budget.     */
+DRESULT disk_stop (
+   uint8_t drv             /* Physical drive nmuber (0) */
+)
+{
+   DRESULT dr = disk_result(drv);
+   if (dr != RES_OK) return dr;
+
+   return stop_stream() ? RES_OK : RES_ERROR;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Close an open write stream and wait for the card to finish           */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_flush (
+   uint8_t drv             /* Physical drive nmuber (0) */
+)
+{
+   DRESULT dr = disk_result(drv);
+   if (dr != RES_OK) return dr;
+
+   /* A CMD24, or a stream stop_stream() already closed, can leave the */
+   /* card programming just as well as the CMD25 closed here.           */
+   if (Stream == STREAM_WRITE && !stop_stream()) return RES_ERROR;
+   if (!WritePending) return RES_OK;
+   if (!select()) return RES_ERROR;      /* Wait until it is programmed */
    deselect();
+   return RES_OK;
+}
+
 
-   return count ? RES_ERROR : RES_OK;
+/*-----------------------------------------------------------------------*/
+/* Is a CMD18 or CMD25 left open for the next request?                   */
+/*-----------------------------------------------------------------------*/
+
+bool disk_streaming (void)
+{
+   return Stream != STREAM_NONE;
 }
 
 
@@ -908,10 +1550,11 @@ DRESULT disk_ioctl (
    DRESULT dr = disk_result(drv);
    if (dr != RES_OK) return dr;
 
+   n = stop_stream();
    res = RES_ERROR;
    switch (ctrl) {
       case CTRL_SYNC :     /* Make sure that no pending write process */
-         if (select()) res = RES_OK;
+         if (n && select()) res = RES_OK;
          break;
 
       case GET_SECTOR_COUNT : /* Get number of sectors on the disk (uint32_t) */
@@ -0,0 +1,184 @@
+/* sdstat.c - dump or reset the SD driver's operation counters          */
+/*                                                                      */
+/* This program is free software; you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation; either version 2 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This program is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANT- */
+/* ABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General    */
+/* Public License for more details.                                     */
+/*                                                                      */
+/*   Usage:  SDSTAT d: [/H] [/R]                                        */
+/*                                                                      */
+/*   Reads the counters and the cache statistics with IOCTL input (INT  */
+/* 21h AX=4404h) and prints them.  /H adds the request latency          */
+/* histograms, /R then zeroes the counters and the histograms with      */
+/* IOCTL output (AX=4405h).                                             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <dos.h>
+#include <i86.h>
+
+#include "stats.h"
+
+static const char *command_names[STATS_COMMANDS] = {
+  "Init", "Media check", "Build BPB", "IOCTL input", "Input",
+  "Non-destructive input", "Input status", "Input flush", "Output",
+  "Output with verify", "Output status", "Output flush", "IOCTL output",
+  "Open", "Close", "Removable media", "Output until busy", "(11h)",
+  "(12h)", "Generic IOCTL", "(14h)", "(15h)", "(16h)", "Get logical device",
+  "Set logical device", "IOCTL query"
+};
+
+static const char *error_names[STATS_ERRORS] = {
+  "Write protect", "Unknown unit", "Not ready", "Unknown command",
+  "CRC error", "Bad length", "Seek error", "Unknown media",
+  "Sector not found", "Out of paper", "Write fault", "Read fault",
+  "General failure", "(0Dh)", "(0Eh)", "Invalid disk change"
+};
+
+static const char *transfer_names[LAT_XFER_ROWS] = {
+  "Rd hit1", "Rd hitN", "Rd mis1", "Rd misN",
+  "Wr hit1", "Wr hitN", "Wr mis1", "Wr misN"
+};
+
+static SdStats stats;
+static SdLatency latency;
+static SdCacheStats cache;
+
+/* drive_ioctl - issue IOCTL input or output (4404h/4405h) for drive 1=A:... */
+static int drive_ioctl (unsigned char function, unsigned char drive, void *buf, unsigned len)
+{
+  union REGS r;
+  struct SREGS s;
+
+  segread(&s);
+  r.h.ah = 0x44;
+  r.h.al = function;
+  r.h.bl = drive;
+  r.x.cx = len;
+  r.x.dx = FP_OFF((void far *)buf);
+  s.ds = FP_SEG((void far *)buf);
+  int86x(0x21, &r, &r, &s);
+  if (r.x.cflag) return r.x.ax;   /* DOS error code */
+  return 0;
+}
+
+/* print_row - one histogram row, skipped if it is empty.  Fits in 79   */
+/* columns: a 7 character name and twelve 6 character counts.          */
+static void print_row (const char *name, uint32_t *row)
+{
+  int b;
+
+  for (b = 0; b < LAT_BUCKETS && !row[b]; ++b)
+    ;
+  if (b == LAT_BUCKETS) return;
+  printf("%-7.7s", name);
+  for (b = 0; b < LAT_BUCKETS; ++b)
+    printf(" %5lu", row[b]);
+  printf("\n");
+}
+
+static void print_latency (void)
+{
+  char name[8];
+  int i;
+
+  printf("Latency in VIA ticks (about 1us), by command code and transfer type:\n");
+  printf("          <64  <128  <256  <512   <1K   <2K   <4K   <8K  <16K  <32K  <64K  64K+\n");
+  for (i = 0; i < STATS_COMMANDS; ++i) {
+    sprintf(name, "%02Xh", i);
+    print_row(name, latency.lt_command[i]);
+  }
+  for (i = 0; i < LAT_XFER_ROWS; ++i)
+    print_row(transfer_names[i], latency.lt_transfer[i]);
+  printf("Slowest request: %s, ", command_names[latency.lt_worst_command]);
+  if (latency.lt_worst_ticks == 0xFFFF) printf("64K+ ticks");
+  else printf("%u ticks", latency.lt_worst_ticks);
+  if (latency.lt_worst_count)
+    printf(", sector %lu count %u", latency.lt_worst_lbn, latency.lt_worst_count);
+  printf("\n");
+}
+
+int main (int argc, char *argv[])
+{
+  unsigned char drive;
+  int reset = 0, histograms = 0;
+  int i, err;
+
+  if (argc < 2 || !isalpha(argv[1][0]) || argv[1][1] != ':') {
+    fprintf(stderr, "Usage: SDSTAT d: [/H] [/R]\n");
+    return 1;
+  }
+  drive = (unsigned char)(toupper(argv[1][0]) - 'A' + 1);
+  for (i = 2; i < argc; ++i) {
+    if (argv[i][0] != '/' && argv[i][0] != '-') continue;
+    if (toupper(argv[i][1]) == 'R') reset = 1;
+    if (toupper(argv[i][1]) == 'H') histograms = 1;
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  stats.st_ioctl_type = GET_STATS;
+  if ((err = drive_ioctl(0x04, drive, &stats, sizeof(stats))) != 0 || stats.st_ioctl_status) {
+    fprintf(stderr, "SDSTAT: %c: does not report SD driver counters (error %d)\n",
+            argv[1][0], err);
+    return 2;
+  }
+
+  printf("Requests by command:\n");
+  for (i = 0; i < STATS_COMMANDS; ++i)
+    if (stats.st_requests[i])
+      printf("  %02Xh %-22s %10lu\n", i, command_names[i], stats.st_requests[i]);
+  printf("Errors returned to DOS:\n");
+  for (i = 0; i < STATS_ERRORS; ++i)
+    if (stats.st_errors[i])
+      printf("  %02Xh %-22s %10lu\n", i, error_names[i], stats.st_errors[i]);
+  printf("Sectors read             %10lu\n", stats.st_sectors_read);
+  printf("Sectors written          %10lu\n", stats.st_sectors_written);
+  printf("Single-block commands    %10lu\n", stats.st_single_cmds);
+  printf("Multi-block commands     %10lu\n", stats.st_multi_cmds);
+  printf("CMD12 stops              %10lu\n", stats.st_cmd12);
+  printf("Busy polls (wait_ready)  %10lu\n", stats.st_ready_spins);
+  printf("Data token polls         %10lu\n", stats.st_token_spins);
+  printf("Card initializations     %10lu\n", stats.st_reinits);
+
+  memset(&cache, 0, sizeof(cache));
+  cache.cs_ioctl_type = GET_CACHE_STATS;
+  if ((err = drive_ioctl(0x04, drive, &cache, sizeof(cache))) != 0 || cache.cs_ioctl_status) {
+    fprintf(stderr, "SDSTAT: cache statistics not available (error %d)\n", err);
+    return 2;
+  }
+  printf("Cache slots              %10u\n", cache.cs_slots);
+  printf("Cache hits (sectors)     %10lu\n", cache.cs_hits);
+  printf("Cache misses (sectors)   %10lu\n", cache.cs_misses);
+  printf("Prefetched sectors       %10lu\n", cache.cs_prefetched);
+  printf("Prefetch hits            %10lu\n", cache.cs_prefetch_hits);
+  printf("Prefetch wasted          %10lu\n", cache.cs_prefetch_wasted);
+  printf("Pinned slots             %10u\n", cache.cs_pinned);
+
+  if (histograms) {
+    memset(&latency, 0, sizeof(latency));
+    latency.lt_ioctl_type = GET_LATENCY;
+    if ((err = drive_ioctl(0x04, drive, &latency, sizeof(latency))) != 0 || latency.lt_ioctl_status) {
+      fprintf(stderr, "SDSTAT: latency histograms not available (error %d)\n", err);
+      return 2;
+    }
+    print_latency();
+  }
+
+  if (reset) {
+    stats.st_ioctl_type = RESET_STATS;
+    stats.st_ioctl_status = 0;
+    if ((err = drive_ioctl(0x05, drive, &stats, 2)) != 0 || stats.st_ioctl_status) {
+      fprintf(stderr, "SDSTAT: reset failed (error %d)\n", err);
+      return 2;
+    }
+    printf("Counters reset.\n");
+  }
+  return 0;
+}
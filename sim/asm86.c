@@ -0,0 +1,417 @@
+/* asm86.c - run sdmm.c's #pragma aux SPI kernels on the host          */
+/*                                                                      */
+/*   With USE_ASM_SPI the host build calls sim_asm_kernel() in place of */
+/* rcvr_kernel() and xmit_kernel().  Their instruction text is read     */
+/* out of sdmm.c itself, the #pragma aux block and the RCVR_BIT and    */
+/* XMIT_BIT style macros it uses, and interpreted here one instruction */
+/* at a time: only the handful of 8086 instructions the kernels need,  */
+/* with accesses to the VIA going to the via6522 model.  So what is    */
+/* checked is the text Open Watcom assembles, not a C rewrite of it.   */
+/*                                                                      */
+/*   The buffer is copied to and from SCRATCH_SEG, as the driver's      */
+/* far pointers may point outside sim_mem on the host.  Time is the     */
+/* 8088 execution clocks from the instruction tables at 5MHz, as in     */
+/* dosenv.c; the VIA accesses the kernel makes are part of that, so    */
+/* only the rest is added to sim_ticks.  asm_clocks keeps the total.    */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "sim.h"
+
+#ifndef SDMM_SOURCE
+#define SDMM_SOURCE "../sdmm.c"
+#endif
+
+#define SCRATCH_SEG  0x8000      /* Kernel buffer, clear of dosenv.h's */
+#define VIA_LO       0xE8000UL   /* VIA registers go to the model */
+#define VIA_HI       0xE8100UL
+
+#define MAX_LINES    512
+#define MAX_KERNELS  4
+
+uint32_t asm_clocks;
+
+typedef struct {
+  char name[32];
+  int first, count;          /* Instructions in insn[] */
+  char parm[2][2][4];        /* Registers of each argument: [es di] [cx] */
+} Kernel;
+
+static char *insn[MAX_LINES];
+static int ninsn;
+static Kernel kernels[MAX_KERNELS];
+static int nkernels;
+static int loaded;
+
+/* Source text, for macro lookups while loading */
+static char *source;
+
+/*---------------------------------------------------------------------*/
+/* Loading                                                             */
+/*---------------------------------------------------------------------*/
+
+static void fail (const char *what, const char *detail)
+{
+  fprintf(stderr, "asm86: %s%s%s\n", what, detail ? ": " : "", detail ? detail : "");
+  exit(2);
+}
+
+/* Append the strings and macro names of a backslash-continued block */
+/* starting at p, up to the "parm" line (or the end of a #define).    */
+static const char *collect (const char *p, int depth);
+
+static void expand_macro (const char *name, int depth)
+{
+  char key[80];
+  const char *p;
+
+  if (depth > 4) fail("macro nesting too deep", name);
+  snprintf(key, sizeof(key), "#define %s ", name);
+  p = strstr(source, key);
+  if (!p) {
+    snprintf(key, sizeof(key), "#define %s\\", name);
+    p = strstr(source, key);
+  }
+  if (!p) fail("macro not found in " SDMM_SOURCE, name);
+  collect(p + strlen("#define ") + strlen(name), depth + 1);
+}
+
+static const char *collect (const char *p, int depth)
+{
+  char word[64];
+  const char *q;
+  int n;
+
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == '\\' || *p == '\r') p++;
+    if (*p == '\n') {
+      /* A line not ending in a backslash ends the block */
+      for (q = p - 1; q > source && (*q == ' ' || *q == '\t' || *q == '\r'); q--) ;
+      if (*q != '\\') return p;
+      p++;
+      continue;
+    }
+    if (*p == '"') {
+      q = strchr(p + 1, '"');
+      if (!q) fail("unterminated string", NULL);
+      if (ninsn >= MAX_LINES) fail("kernel too long", NULL);
+      insn[ninsn++] = strndup(p + 1, (size_t)(q - p - 1));
+      p = q + 1;
+      continue;
+    }
+    if (isalpha((unsigned char)*p) || *p == '_') {
+      for (n = 0; (isalnum((unsigned char)p[n]) || p[n] == '_') && n < 63; n++)
+        word[n] = p[n];
+      word[n] = '\0';
+      if (!strcmp(word, "parm") || !strcmp(word, "modify") || !strcmp(word, "value"))
+        return p;
+      expand_macro(word, depth);
+      p += n;
+      continue;
+    }
+    if (!*p) return p;
+    p++;
+  }
+}
+
+/* "parm [es di] [cx]" */
+static void parse_parm (Kernel *k, const char *p)
+{
+  int a = 0, r;
+
+  memset(k->parm, 0, sizeof(k->parm));
+  p += 4;
+  while (*p && *p != '\n' && a < 2) {
+    if (*p++ != '[') continue;
+    for (r = 0; r < 2 && *p != ']'; r++) {
+      while (*p == ' ') p++;
+      sscanf(p, "%3[a-z]", k->parm[a][r]);
+      while (isalpha((unsigned char)*p)) p++;
+      while (*p == ' ') p++;
+    }
+    a++;
+  }
+}
+
+static void load (void)
+{
+  FILE *f = fopen(SDMM_SOURCE, "r");
+  const char *p, *q;
+  long size;
+  Kernel *k;
+
+  if (!f) fail("cannot open", SDMM_SOURCE);
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  source = malloc((size_t)size + 1);
+  if (!source || fread(source, 1, (size_t)size, f) != (size_t)size) fail("cannot read", SDMM_SOURCE);
+  source[size] = '\0';
+  fclose(f);
+
+  for (p = source; (p = strstr(p, "#pragma aux ")) != NULL; p = q) {
+    p += strlen("#pragma aux ");
+    q = strchr(p, '\n');
+    if (!q || !memchr(p, '=', (size_t)(q - p))) continue;     /* Not a code pragma */
+    if (nkernels >= MAX_KERNELS) break;
+    k = &kernels[nkernels];
+    sscanf(p, "%31[A-Za-z0-9_]", k->name);
+    if (strncmp(k->name, "rcvr_kernel", 11) && strncmp(k->name, "xmit_kernel", 11))
+      continue;
+    k->first = ninsn;
+    q = collect(strchr(p, '=') + 1, 0);
+    k->count = ninsn - k->first;
+    if (strncmp(q, "parm", 4)) fail("no parm line", k->name);
+    parse_parm(k, q);
+    nkernels++;
+  }
+  loaded = 1;
+}
+
+/*---------------------------------------------------------------------*/
+/* The machine                                                         */
+/*---------------------------------------------------------------------*/
+
+enum { AX, CX, DX, BX, SP, BP, SI, DI, NREG };
+enum { ES, CS, SS, DS, NSREG };
+
+static uint16_t reg[NREG], sreg[NSREG];
+static int cf;
+static uint16_t stack[16];
+static int sp;
+
+static const char *reg16_names[NREG] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" };
+static const char *reg8_names[8] = { "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh" };
+static const char *sreg_names[NSREG] = { "es", "cs", "ss", "ds" };
+
+typedef struct {
+  int kind;                  /* O_REG8, O_REG16, O_SREG, O_IMM, O_MEM */
+  int n;                     /* Register number or immediate */
+  int seg;                   /* O_MEM: segment register */
+  int base;                  /* O_MEM: base register or -1 */
+  uint16_t disp;
+} Operand;
+
+enum { O_NONE, O_REG8, O_REG16, O_SREG, O_IMM, O_MEM };
+
+static int lookup (const char *s, const char **names, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) if (!strcmp(s, names[i])) return i;
+  return -1;
+}
+
+static void operand (const char *text, Operand *o, const char *line)
+{
+  char s[64], *p = s, *e;
+  int i;
+
+  snprintf(s, sizeof(s), "%s", text);
+  while (*p == ' ') p++;
+  for (e = p + strlen(p); e > p && e[-1] == ' '; ) *--e = '\0';
+  if (!strncmp(p, "byte ptr ", 9)) p += 9;
+  memset(o, 0, sizeof(*o));
+  o->seg = DS;
+  o->base = -1;
+
+  if (strchr(p, '[')) {
+    o->kind = O_MEM;
+    if (p[2] == ':') {
+      p[2] = '\0';
+      if ((o->seg = lookup(p, sreg_names, NSREG)) < 0) fail("bad segment", line);
+      p += 3;
+    }
+    if (*p++ != '[' || !(e = strchr(p, ']'))) fail("bad memory operand", line);
+    *e = '\0';
+    if ((i = lookup(p, reg16_names, NREG)) >= 0) o->base = i;
+    else o->disp = (uint16_t)strtoul(p, NULL, 0);
+  } else if ((i = lookup(p, reg8_names, 8)) >= 0) {
+    o->kind = O_REG8;  o->n = i;
+  } else if ((i = lookup(p, reg16_names, NREG)) >= 0) {
+    o->kind = O_REG16; o->n = i;
+  } else if ((i = lookup(p, sreg_names, NSREG)) >= 0) {
+    o->kind = O_SREG;  o->n = i;
+  } else if (isdigit((unsigned char)*p)) {
+    o->kind = O_IMM;   o->n = (int)strtoul(p, NULL, 0);
+  } else fail("bad operand", line);
+}
+
+static uint8_t get8 (int r)
+{
+  return (r < 4) ? (uint8_t)reg[r] : (uint8_t)(reg[r - 4] >> 8);
+}
+
+static void set8 (int r, uint8_t v)
+{
+  if (r < 4) reg[r] = (reg[r] & 0xFF00) | v;
+  else reg[r - 4] = (uint16_t)((reg[r - 4] & 0x00FF) | (v << 8));
+}
+
+static uint32_t linear (const Operand *o)
+{
+  uint16_t off = o->disp + (o->base >= 0 ? reg[o->base] : 0);
+
+  return (((uint32_t)sreg[o->seg] << 4) + off) & 0xFFFFF;
+}
+
+static uint8_t mem_rd (uint32_t a)
+{
+  if (a >= VIA_LO && a < VIA_HI) return sim_via_read(&sim_mem[a]);
+  return sim_mem[a];
+}
+
+static void mem_wr (uint32_t a, uint8_t v)
+{
+  if (a >= VIA_LO && a < VIA_HI) sim_via_write(&sim_mem[a], v);
+  else sim_mem[a] = v;
+}
+
+/* 8088 clocks for a direct or register-indirect memory operand */
+static int ea_clocks (const Operand *o)
+{
+  return (o->base >= 0 ? 5 : 6) + (o->seg != DS ? 2 : 0);
+}
+
+static uint8_t read8 (const Operand *o, const char *line)
+{
+  switch (o->kind) {
+  case O_REG8: return get8(o->n);
+  case O_IMM:  return (uint8_t)o->n;
+  case O_MEM:  return mem_rd(linear(o));
+  }
+  fail("not a byte operand", line);
+  return 0;
+}
+
+static void write8 (const Operand *o, uint8_t v, const char *line)
+{
+  if (o->kind == O_REG8) set8(o->n, v);
+  else if (o->kind == O_MEM) mem_wr(linear(o), v);
+  else fail("not a byte destination", line);
+}
+
+/* Run instructions first..first+count-1; labels are "name:" lines */
+static void run (int first, int count)
+{
+  char op[16], args[64], *comma;
+  Operand a, b;
+  int pc, i, clocks;
+  const char *line;
+  uint8_t v;
+
+  for (pc = first; pc < first + count; pc++) {
+    line = insn[pc];
+    if (line[strlen(line) - 1] == ':') continue;
+    args[0] = '\0';
+    if (sscanf(line, "%15s %63[^\n]", op, args) < 1) continue;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    if ((comma = strchr(args, ',')) != NULL) {
+      *comma = '\0';
+      operand(args, &a, line);
+      operand(comma + 1, &b, line);
+    } else if (args[0] && strcmp(op, "loop")) {
+      operand(args, &a, line);
+    }
+    clocks = 0;
+
+    if (!strcmp(op, "mov")) {
+      if (a.kind == O_REG16 && b.kind == O_IMM) { reg[a.n] = (uint16_t)b.n; clocks = 4; }
+      else if (a.kind == O_SREG && b.kind == O_REG16) { sreg[a.n] = reg[b.n]; clocks = 2; }
+      else if (a.kind == O_REG8 && b.kind == O_REG8) { set8(a.n, get8(b.n)); clocks = 2; }
+      else if (a.kind == O_MEM && b.kind == O_IMM) { write8(&a, (uint8_t)b.n, line); clocks = 10 + ea_clocks(&a); }
+      else if (a.kind == O_MEM) { write8(&a, read8(&b, line), line); clocks = 9 + ea_clocks(&a); }
+      else if (b.kind == O_MEM) { write8(&a, read8(&b, line), line); clocks = 8 + ea_clocks(&b); }
+      else fail("unsupported mov", line);
+    } else if (!strcmp(op, "shl") || !strcmp(op, "rcl")) {
+      if (a.kind != O_REG8 || b.kind != O_IMM || b.n != 1) fail("unsupported shift", line);
+      v = get8(a.n);
+      i = (v >> 7) & 1;
+      v = (uint8_t)((v << 1) | (op[0] == 'r' ? cf : 0));
+      cf = i;
+      set8(a.n, v);
+      clocks = 2;
+    } else if (!strcmp(op, "xor") || !strcmp(op, "or")) {
+      v = (op[0] == 'x') ? (read8(&a, line) ^ read8(&b, line)) : (read8(&a, line) | read8(&b, line));
+      write8(&a, v, line);
+      cf = 0;
+      clocks = (b.kind == O_IMM) ? 4 : 3;
+    } else if (!strcmp(op, "inc")) {
+      if (a.kind != O_REG16) fail("unsupported inc", line);
+      reg[a.n]++;
+      clocks = 2;
+    } else if (!strcmp(op, "lodsb")) {
+      set8(0, mem_rd((((uint32_t)sreg[DS] << 4) + reg[SI]) & 0xFFFFF));
+      reg[SI]++;
+      clocks = 12;
+    } else if (!strcmp(op, "push")) {
+      if (a.kind != O_SREG || sp >= 16) fail("unsupported push", line);
+      stack[sp++] = sreg[a.n];
+      clocks = 14;
+    } else if (!strcmp(op, "pop")) {
+      if (a.kind != O_SREG || sp <= 0) fail("unsupported pop", line);
+      sreg[a.n] = stack[--sp];
+      clocks = 12;
+    } else if (!strcmp(op, "loop")) {
+      clocks = 5;
+      if (--reg[CX]) {
+        for (i = first; i < first + count; i++)
+          if (!strncmp(insn[i], args, strlen(args)) && insn[i][strlen(args)] == ':') break;
+        if (i == first + count) fail("loop target not found", line);
+        pc = i;
+        clocks = 17;
+      }
+    } else fail("unsupported instruction", line);
+
+    asm_clocks += (uint32_t)clocks;
+  }
+  if (sp) fail("unbalanced push/pop", NULL);
+}
+
+/* Put a parm argument into the registers it names: a far pointer as */
+/* [seg off], anything else in a single register.                     */
+static void load_parm (const char regs[2][4], uint16_t seg, uint16_t value)
+{
+  int r, i;
+
+  for (i = 0; i < 2 && regs[i][0]; i++) {
+    uint16_t v = (i == 0 && regs[1][0]) ? seg : value;
+
+    if ((r = lookup(regs[i], sreg_names, NSREG)) >= 0) sreg[r] = v;
+    else if ((r = lookup(regs[i], reg16_names, NREG)) >= 0) reg[r] = v;
+    else fail("bad parm register", regs[i]);
+  }
+}
+
+void sim_asm_kernel (const char *name, uint8_t *buff, uint16_t bc)
+{
+  uint8_t *scratch = &sim_mem[(uint32_t)SCRATCH_SEG << 4];
+  uint32_t clocks = asm_clocks, accesses, ticks = sim_ticks;
+  int i;
+  Kernel *k = NULL;
+
+  if (!loaded) load();
+  for (i = 0; i < nkernels; i++)
+    if (!strcmp(kernels[i].name, name)) k = &kernels[i];
+  if (!k) fail("kernel not found in " SDMM_SOURCE, name);
+
+  memset(reg, 0, sizeof(reg));
+  sreg[DS] = 0x0070;          /* Anything but the buffer's segment */
+  sreg[ES] = sreg[SS] = sreg[CS] = 0;
+  sp = 0;
+  memcpy(scratch, buff, bc);
+  load_parm(k->parm[0], SCRATCH_SEG, 0);
+  load_parm(k->parm[1], 0, bc);
+  run(k->first, k->count);
+  if (sreg[DS] != 0x0070) fail("kernel did not restore DS", name);
+  memcpy(buff, scratch, bc);
+
+  /* The model charged a tick per VIA access; add the rest of the clocks */
+  accesses = sim_ticks - ticks;
+  clocks = (asm_clocks - clocks + 4) / 5;
+  if (clocks > accesses) sim_ticks += clocks - accesses;
+}
@@ -0,0 +1,95 @@
+/* dosenv.c - what DOS and the 8088 provide to template.c and devinit.c */
+/*                                                                      */
+/*   The inline assembly in template.h has no host equivalent, so it is */
+/* replaced here by functions that charge sim_ticks an estimate of what */
+/* the real instructions cost: 8088 clocks from the instruction tables, */
+/* at 5MHz, rounded up to whole VIA ticks (1us).  The driver is loaded  */
+/* at DRIVER_SEG with its device header at offset 0.                    */
+
+#include <stdio.h>
+
+#include "template.h"
+#include "sim.h"
+#include "dosenv.h"
+
+static sim_vector_t vectors[256];
+static int on_driver_stack;
+
+void get_all_registers (struct ALL_REGS *regs)
+{
+  regs->cs = regs->ds = DRIVER_SEG;
+  regs->es = regs->ss = DOS_SEG;
+  regs->ax = regs->bx = regs->cx = regs->dx = 0;
+}
+
+/* cli, two stores of SS:SP, push cs / pop ss, load SP, sti: ~70 clocks */
+void switch_stack (void)
+{
+  on_driver_stack = 1;
+  sim_ticks += 14;
+}
+
+/* cli, reload SP and SS, sti: ~50 clocks */
+void restore_stack (void)
+{
+  on_driver_stack = 0;
+  sim_ticks += 10;
+}
+
+/* pushf, eight general and two segment pushes, push cs / pop ds: ~190 */
+void push_regs (void)
+{
+  sim_ticks += 38;
+}
+
+/* The pops and popf: ~130 clocks */
+void pop_regs (void)
+{
+  sim_ticks += 26;
+}
+
+__segment getCS (void)
+{
+  return DRIVER_SEG;
+}
+
+__segment getSS (void)
+{
+  return on_driver_stack ? DRIVER_SEG : DOS_SEG;
+}
+
+void Enable (void)
+{
+}
+
+/* INT 21h AH=09h: print up to the '$' */
+void printMsg (const char *msg)
+{
+  while (*msg && *msg != '$') putchar(*msg++);
+}
+
+sim_vector_t _dos_getvect (unsigned vector)
+{
+  return vectors[vector & 0xFF];
+}
+
+void _dos_setvect (unsigned vector, sim_vector_t handler)
+{
+  vectors[vector & 0xFF] = handler;
+}
+
+/* Nothing is chained behind the driver's handlers */
+void _chain_intr (sim_vector_t handler)
+{
+  (void)handler;
+}
+
+/* Raise a software interrupt the driver may have hooked (INT 28h etc.) */
+int dos_interrupt (unsigned vector)
+{
+  sim_vector_t handler = vectors[vector & 0xFF];
+
+  if (!handler) return 0;
+  handler();
+  return 1;
+}
@@ -0,0 +1,12 @@
+/* dosenv.h - the simulated DOS side of the driver (dosenv.c)           */
+
+#ifndef _DOSENV_H
+#define _DOSENV_H
+
+#define DRIVER_SEG  0x1000     /* Where "DOS" loaded the driver */
+#define DOS_SEG     0x0070     /* DOS's own segment, for its stack */
+#define BUFFER_SEG  0x6000     /* DOS transfer buffers, up to 64K */
+
+int dos_interrupt (unsigned vector);
+
+#endif
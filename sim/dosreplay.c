@@ -0,0 +1,514 @@
+/* dosreplay.c - replay DOS request workloads through the whole driver   */
+/*                                                                      */
+/*   Usage:  dosreplay [-o options] [-w n] [-s n] [-k out] [-c] [-f]    */
+/*                     [-v] image workload...                           */
+/*                                                                      */
+/*   Loads the driver the way DOS does: an INIT request whose command   */
+/* line is "PARAPSD.SYS <options> /W=n", then MEDIA_CHECK, GET_BPB,      */
+/* INPUT and OUTPUT packets handed to DeviceStrategy() and              */
+/* DeviceInterrupt() exactly as the kernel would, so the cost reported */
+/* includes the stack switch, the register saves, the unit check, the  */
+/* cache and the trace, not just the SPI transfer.  Transfers use DOS   */
+/* buffers at BUFFER_SEG:0.  Every sector returned through r_trans is   */
+/* checked against a private copy of the image that also tracks what   */
+/* the workload wrote, and after the final media check the card is      */
+/* compared with that copy.  The image file itself is never modified;   */
+/* -k writes the card as the run left it to another file, for           */
+/* readlog.py or cachesim.py to pick the /T trace out of.  -f turns on  */
+/* the card's flash model, which charges for writes that split a 16K    */
+/* recording unit or move to another 4M allocation unit, to compare     */
+/* volume layouts (sdformat.py) on the same workload.  -s n cuts every  */
+/* INPUT and OUTPUT into packets of at most n sectors, as the driver's  */
+/* old 16-sector chunking did, so "cmds/req" (CMD17/18/24/25 and CMD12  */
+/* per request) shows what issuing the whole request at once saves.     */
+/*                                                                      */
+/*   A workload file has one request per line, '#' starts a comment:    */
+/*                                                                      */
+/*      media | bpb                                                     */
+/*      read  lbn count [repeat [step]]    INPUT                        */
+/*      write lbn count [repeat [step]]    OUTPUT                       */
+/*      verify lbn count [repeat [step]]   OUTPUT with verify           */
+/*      idle n                             n INT 28h calls              */
+/*      tick n                             n INT 1Ch calls              */
+/*      cut                                power cuts during a flush    */
+/*                                                                      */
+/* lbn is relative to the partition, as DOS sees it, or one of cN, fN,  */
+/* gN and rN for sector 0 of cluster N, sector N of FAT #1 or FAT #2    */
+/* and sector N of the root directory, placed by the volume's BPB, so   */
+/* that a workload runs unchanged on any layout.  The "access",         */
+/* "read:", "write:", "mediaCheck:" and "buildBpb:" lines readlog.py    */
+/* prints from a /T trace are accepted too, so a real session replays   */
+/* as taken.  Don't feed it both the access and the read:/write: lines  */
+/* of a /T=3 trace, they are the same requests.  If the idle engine     */
+/* writes anything during an idle or tick line, it must not leave a     */
+/* CMD25 open behind it, and with neither /C nor /F no request may be   */
+/* filed as a cache hit in the driver's latency histogram.              */
+/*                                                                      */
+/*   "cut" takes the sectors the write-back cache (/L) holds dirty and, */
+/* for every block of the flush a MEDIA_CHECK would make, replays that  */
+/* flush in a child process with the card's power cut after the block. */
+/* What reached the card must be a prefix of the dirty sectors in LBA  */
+/* order, each with its new data, and nothing else may have changed.   */
+/* The workload then carries on as if the cut never happened.          */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "device.h"
+#include "template.h"
+#include "diskio.h"
+#include "sd.h"
+#include "cache.h"
+#include "stats.h"
+#include "sim.h"
+#include "dosenv.h"
+
+/* cstrtsys.asm provides these in the real driver */
+void *transient_data;
+extern SdStats sd_stats;
+extern void __far DeviceStrategy (request __far *req);
+extern void __far DeviceInterrupt (void);
+
+#define MAX_SECTORS  128         /* 64K, the most DOS transfers at once */
+#define NCOMMANDS    (C_CLOSE + 1)
+
+static const char *command_names[NCOMMANDS] = {
+  "INIT", "MEDIA_CHECK", "GET_BPB", "IOCTL_IN", "INPUT", "", "", "",
+  "OUTPUT", "OUTPUT_VFY", "", "", "IOCTL_OUT", "OPEN", "CLOSE"
+};
+
+typedef struct {
+  uint32_t requests;
+  uint32_t sectors;
+  uint32_t port_accesses;
+  uint32_t sclk_edges;
+  uint32_t ticks;
+  uint32_t card_cmds;        /* CMD17/18/24/25 and CMD12 sent */
+  uint32_t worst;            /* Slowest request in this workload, ticks */
+  uint32_t errors;
+} CommandCost;
+
+static CommandCost cost[NCOMMANDS];
+static request *rq;              /* The packet, in DOS's segment */
+static uint8_t *buffer;          /* The transfer buffer, BUFFER_SEG:0 */
+static uint8_t *expected;        /* What every image sector should hold */
+static uint32_t image_sectors;
+static uint32_t generation;      /* Makes each write's data different */
+static uint32_t bad_sectors;
+static uint16_t chunk = MAX_SECTORS;   /* -s: most sectors per packet */
+
+extern bpb my_bpb;
+
+/* Hand one packet to the driver and account for what it cost */
+static uint16_t issue (uint8_t command, uint32_t sectors)
+{
+  SimCounters before = sim_count;
+  uint32_t ticks = sim_ticks, spent;
+  uint32_t cmds = sd_stats.st_single_cmds + sd_stats.st_multi_cmds + sd_stats.st_cmd12;
+  CommandCost *c = &cost[command];
+
+  rq->r_length = sizeof(request);
+  rq->r_unit = 0;
+  rq->r_command = command;
+  rq->r_status = 0;
+  DeviceStrategy(rq);
+  DeviceInterrupt();
+
+  spent = sim_ticks - ticks;
+  c->requests++;
+  c->sectors += sectors;
+  c->port_accesses += sim_count.port_reads - before.port_reads
+                    + sim_count.port_writes - before.port_writes;
+  c->sclk_edges += sim_count.sclk_edges - before.sclk_edges;
+  c->card_cmds += sd_stats.st_single_cmds + sd_stats.st_multi_cmds + sd_stats.st_cmd12 - cmds;
+  c->ticks += spent;
+  if (spent > c->worst) c->worst = spent;
+  if (rq->r_status & S_ERROR) c->errors++;
+  return rq->r_status;
+}
+
+static int init_driver (const char *options, int wiring)
+{
+  static char line[256];
+  struct device_header *dh = MK_FP(DRIVER_SEG, 0);
+  void far *end;
+
+  memset(dh, 0, sizeof(*dh));
+  dh->dh_attr = ATTR_HUGE;
+  dh->dh_num_drives = 1;
+  snprintf(line, sizeof(line), "PARAPSD.SYS %s%s/W=%d\r\n", options, *options ? " " : "", wiring);
+
+  memset(rq, 0, sizeof(*rq));
+  rq->r_bpbptr = (void far *)line;
+  rq->r_firstunit = 2;           /* C: */
+  if (issue(C_INIT, 0) & S_ERROR || rq->r_nunits == 0) {
+    printf("INIT failed, status %04x\n", rq->r_status);
+    return 0;
+  }
+  end = rq->r_endaddr;
+  printf("INIT: \"%.*s\", driver ends at %04x:0000, partition at %lu\n",
+         (int)strcspn(line, "\r"), line, FP_SEG(end) + ((FP_OFF(end) + 15) >> 4),
+         (unsigned long)partition_offset);
+  if (FP_SEG(end) >= BUFFER_SEG) {
+    printf("INIT: the driver overlaps the transfer buffer at %04x:0000\n", BUFFER_SEG);
+    return 0;
+  }
+  return 1;
+}
+
+static void pattern (uint8_t *p, uint32_t lbn)
+{
+  int i;
+
+  for (i = 0; i < 512; i++) p[i] = (uint8_t)(lbn * 7 + i * 3 + generation * 13);
+}
+
+static uint8_t *expected_sector (uint32_t lbn)
+{
+  return expected + (size_t)(lbn + partition_offset) * 512;
+}
+
+/* One DOS request, handed over as packets of at most -s sectors the  */
+/* way readBlock() and write_block() used to cut it into 16-sector     */
+/* sd_read()/sd_write() calls, but costed as the one request it is.    */
+static void transfer (uint8_t command, uint32_t lbn, uint16_t count)
+{
+  CommandCost *c = &cost[command];
+  uint32_t requests = c->requests, ticks = c->ticks;
+  uint16_t i, done, n;
+
+  if (count > MAX_SECTORS || lbn + partition_offset + count > image_sectors) {
+    printf("  %s %lu %u: outside the image or too long, skipped\n",
+           command_names[command], (unsigned long)lbn, count);
+    return;
+  }
+  if (command == C_INPUT) {
+    memset(buffer, 0xE5, (size_t)count * 512);
+  } else {
+    generation++;
+    for (i = 0; i < count; i++) pattern(buffer + i * 512, lbn + i);
+  }
+  for (done = 0; done < count; done += n) {
+    n = (count - done > chunk) ? chunk : count - done;
+    memset(&rq->r_rw_ptr, 0, sizeof(rq->r_rw_ptr));
+    rq->r_meddesc = 0xF8;
+    rq->r_trans = MK_FP(BUFFER_SEG + done * 32, 0);
+    rq->r_count = n;
+    rq->r_start = lbn + done;
+    if (issue(command, n) & S_ERROR) {
+      printf("  %s %lu %u: status %04x\n", command_names[command],
+             (unsigned long)(lbn + done), n, rq->r_status);
+      bad_sectors += count;
+      c->requests = requests + 1;
+      return;
+    }
+  }
+  c->requests = requests + 1;
+  if (c->ticks - ticks > c->worst) c->worst = c->ticks - ticks;
+  for (i = 0; i < count; i++) {
+    if (command != C_INPUT) {
+      memcpy(expected_sector(lbn + i), buffer + i * 512, 512);
+    } else if (memcmp(buffer + i * 512, expected_sector(lbn + i), 512)) {
+      printf("  INPUT %lu %u: sector %lu does not match the image\n",
+             (unsigned long)lbn, count, (unsigned long)(lbn + i));
+      bad_sectors++;
+    }
+  }
+}
+
+#define CUT_MAX  256              /* Dirty sectors "cut" looks at */
+
+/* One power cut, in the child: the flush must have written dirty[0] */
+/* up to dirty[k - 1], in that order, and left the rest as they were.  */
+static int cut_check (const uint32_t *dirty, const uint8_t *old, uint32_t nd, uint32_t k)
+{
+  uint32_t lbn, i;
+  int bad = 0;
+
+  card_writes = 0;
+  card_power_cut((long)k);
+  memset(&rq->r_media_check, 0, sizeof(rq->r_media_check));
+  rq->r_mc_media_desc = 0xF8;
+  issue(C_MEDIACHK, 0);
+
+  if (card_writes != k) {
+    printf("  cut after %lu blocks: the card took %lu\n", (unsigned long)k,
+           (unsigned long)card_writes);
+    bad++;
+  }
+  for (i = 0; i < k && i < card_writes; i++)
+    if (card_write_lba[i] != dirty[i]) {
+      printf("  cut after %lu blocks: block %lu went to %lu, not %lu\n", (unsigned long)k,
+             (unsigned long)i, (unsigned long)card_write_lba[i], (unsigned long)dirty[i]);
+      bad++;
+    }
+  for (i = 0; i < nd; i++)
+    if (memcmp(card_sector(dirty[i]), i < k ? expected + (size_t)dirty[i] * 512
+                                            : old + (size_t)i * 512, 512)) {
+      printf("  cut after %lu blocks: sector %lu holds %s data\n", (unsigned long)k,
+             (unsigned long)dirty[i], i < k ? "old" : "torn or early");
+      bad++;
+    }
+  for (i = 0, lbn = (uint32_t)partition_offset; lbn < image_sectors; lbn++) {
+    if (i < nd && dirty[i] == lbn) {
+      i++;
+      continue;
+    }
+    if (memcmp(card_sector(lbn), expected + (size_t)lbn * 512, 512)) {
+      printf("  cut after %lu blocks: sector %lu was not dirty but changed\n",
+             (unsigned long)k, (unsigned long)lbn);
+      bad++;
+    }
+  }
+  return bad ? 1 : 0;
+}
+
+static void power_cuts (void)
+{
+  static uint32_t dirty[CUT_MAX];
+  static uint8_t old[CUT_MAX * 512];
+  uint32_t nd = 0, lbn, k, failed = 0;
+  int status;
+  pid_t pid;
+
+  for (lbn = (uint32_t)partition_offset; lbn < image_sectors && nd < CUT_MAX; lbn++)
+    if (memcmp(card_sector(lbn), expected + (size_t)lbn * 512, 512)) {
+      memcpy(old + (size_t)nd * 512, card_sector(lbn), 512);
+      dirty[nd++] = lbn;
+    }
+  for (k = 0; k <= nd; k++) {
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+      status = cut_check(dirty, old, nd, k);
+      fflush(stdout);
+      _exit(status);             /* exit() would rewind the workload file */
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid
+        || !WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+  }
+  printf("  cut: %lu dirty sectors, power cut after each of 0..%lu blocks, %lu failed\n",
+         (unsigned long)nd, (unsigned long)nd, (unsigned long)failed);
+  bad_sectors += failed;
+}
+
+/* Value after "key" in a readlog.py line, or -1 */
+static long field (const char *line, const char *key)
+{
+  const char *p = strstr(line, key);
+
+  return p ? strtol(p + strlen(key), NULL, 0) : -1;
+}
+
+/* A workload lbn: a number or cN, fN, gN, rN placed by the BPB */
+static long lbn_value (const char *s)
+{
+  long n = strtol(isdigit((unsigned char)*s) ? s : s + 1, NULL, 0);
+  long root = my_bpb.bpb_nreserved + (long)my_bpb.bpb_nfat * my_bpb.bpb_nfsect;
+
+  switch (*s) {
+  case 'c':
+    return root + (my_bpb.bpb_ndirent + 15) / 16 + (n - 2) * my_bpb.bpb_nsector;
+  case 'f':
+    return my_bpb.bpb_nreserved + n;
+  case 'g':
+    return my_bpb.bpb_nreserved + my_bpb.bpb_nfsect + n;
+  case 'r':
+    return root + n;
+  }
+  return n;
+}
+
+static void replay_line (char *line, const char *where)
+{
+  char word[16], lbn[32];
+  long a[4] = { 0, 0, 1, 0 };
+  uint32_t blocks;
+  int n, i;
+  uint8_t command;
+
+  line[strcspn(line, "#\r\n")] = '\0';
+  if (!strncmp(line, "access ", 7)) line += 7;
+  n = sscanf(line, "%15s %31s %ld %ld %ld", word, lbn, &a[1], &a[2], &a[3]);
+  if (n < 1) return;
+  if (n >= 2) a[0] = lbn_value(lbn);
+
+  if (!strcmp(word, "read:") || !strcmp(word, "write:")) {
+    command = (word[0] == 'r') ? C_INPUT
+            : (field(line, "verify ") > 0) ? C_OUTVFY : C_OUTPUT;
+    transfer(command, (uint32_t)field(line, "start "), (uint16_t)field(line, "count "));
+  } else if (!strcmp(word, "media") || !strcmp(word, "mediaCheck:")) {
+    memset(&rq->r_media_check, 0, sizeof(rq->r_media_check));
+    rq->r_mc_media_desc = 0xF8;
+    issue(C_MEDIACHK, 0);
+  } else if (!strcmp(word, "bpb") || !strcmp(word, "buildBpb:")) {
+    rq->r_bpmdesc = 0xF8;
+    rq->r_bpfat = (void far *)buffer;
+    issue(C_BLDBPB, 0);
+  } else if ((!strcmp(word, "idle") || !strcmp(word, "tick")) && n >= 2) {
+    /* What the idle engine writes back it must also close */
+    blocks = card_writes;
+    for (i = 0; i < a[0]; i++) dos_interrupt(word[0] == 'i' ? 0x28 : 0x1C);
+    if (card_writes != blocks && card_write_open()) {
+      printf("%s: %s left a CMD25 open\n", where, word);
+      bad_sectors++;
+    }
+  } else if (!strcmp(word, "cut")) {
+    power_cuts();
+  } else if ((!strcmp(word, "read") || !strcmp(word, "write") || !strcmp(word, "verify"))
+             && n >= 3) {
+    command = (word[0] == 'r') ? C_INPUT : (word[0] == 'w') ? C_OUTPUT : C_OUTVFY;
+    if (n < 5) a[3] = a[1];      /* Default step: the next run follows on */
+    for (i = 0; i < a[2]; i++)
+      transfer(command, (uint32_t)(a[0] + i * a[3]), (uint16_t)a[1]);
+  } else if (strchr(word, ':') == NULL) {
+    printf("%s: \"%s\" not understood\n", where, line);
+  }
+}
+
+static void report (const char *name, const CommandCost *before)
+{
+  int c;
+  const CommandCost *k;
+
+  printf("%s:\n", name);
+  printf("  %-12s %6s %7s %12s %12s %10s %9s %9s %8s\n", "", "reqs", "sectors",
+         "accesses/req", "edges/req", "ticks/req", "ticks/sec", "worst", "cmds/req");
+  for (c = 0; c < NCOMMANDS; c++) {
+    CommandCost d = cost[c];
+    k = &before[c];
+    d.requests -= k->requests;
+    if (!d.requests) continue;
+    d.sectors -= k->sectors;
+    d.port_accesses -= k->port_accesses;
+    d.sclk_edges -= k->sclk_edges;
+    d.ticks -= k->ticks;
+    d.card_cmds -= k->card_cmds;
+    d.errors -= k->errors;
+    printf("  %-12s %6lu %7lu %12.1f %12.1f %10.1f ", command_names[c],
+           (unsigned long)d.requests, (unsigned long)d.sectors,
+           (double)d.port_accesses / d.requests, (double)d.sclk_edges / d.requests,
+           (double)d.ticks / d.requests);
+    if (d.sectors) printf("%9.1f", (double)d.ticks / d.sectors);
+    else printf("%9s", "-");
+    printf(" %9lu %8.2f", (unsigned long)d.worst, (double)d.card_cmds / d.requests);
+    if (d.errors) printf("  %lu errors", (unsigned long)d.errors);
+    printf("\n");
+  }
+}
+
+static int replay (const char *name)
+{
+  static CommandCost before[NCOMMANDS];
+  char line[256], where[300];
+  FILE *f = fopen(name, "r");
+  int n = 0, c;
+
+  if (!f) {
+    perror(name);
+    return 0;
+  }
+  for (c = 0; c < NCOMMANDS; c++) cost[c].worst = 0;    /* Per workload */
+  memcpy(before, cost, sizeof(cost));
+  while (fgets(line, sizeof(line), f)) {
+    snprintf(where, sizeof(where), "%s:%d", name, ++n);
+    replay_line(line, where);
+  }
+  fclose(f);
+  report(name, before);
+  return 1;
+}
+
+static uint8_t *load_image (const char *name)
+{
+  FILE *f = fopen(name, "rb");
+  uint8_t *p = malloc((size_t)image_sectors * 512);
+
+  if (!f || !p || fread(p, 512, image_sectors, f) != image_sectors) {
+    if (f) fclose(f);
+    free(p);
+    return NULL;
+  }
+  fclose(f);
+  return p;
+}
+
+int main (int argc, char *argv[])
+{
+  static CommandCost zero[NCOMMANDS];
+  const char *image = NULL, *options = "", *keep = NULL;
+  int wiring = WIRE_SHIFTREG, create = 0, first = 0, i, b;
+  uint32_t lbn, differ = 0, filed[2] = { 0, 0 };
+  FILE *f;
+
+  for (i = 1; i < argc && !first; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) options = argv[++i];
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc) wiring = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-k") && i + 1 < argc) keep = argv[++i];
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc) chunk = (uint16_t)atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-c")) create = 1;
+    else if (!strcmp(argv[i], "-f")) card_flash();
+    else if (!strcmp(argv[i], "-v")) debug = true;
+    else if (argv[i][0] != '-' && !image) image = argv[i];
+    else if (argv[i][0] != '-') first = i;
+    else break;
+  }
+  if (!image || !first || wiring < WIRE_BITBANG || wiring > WIRE_CA2 || !chunk) {
+    fprintf(stderr, "Usage: dosreplay [-o \"options\"] [-w 0|1|2] [-s n] [-k out] [-c] [-f] [-v] image workload...\n");
+    return 2;
+  }
+  if (create && (f = fopen(image, "rb")) == NULL) {
+    if (!image_create(image)) {
+      perror(image);
+      return 2;
+    }
+  } else if (create) fclose(f);
+  if (!card_open(image, &image_sectors) || (expected = load_image(image)) == NULL) {
+    perror(image);
+    return 2;
+  }
+
+  rq = MK_FP(DOS_SEG, 0x0100);
+  buffer = MK_FP(BUFFER_SEG, 0);
+  via_wiring(wiring);
+  if (!init_driver(options, wiring)) return 1;
+  report("INIT", zero);
+
+  for (i = first; i < argc; i++) replay(argv[i]);
+
+  /* DOS never sends CLOSE to this driver (no ATTR_EXCALLS).  The next   */
+  /* media check must land anything held back, and back at the prompt    */
+  /* INT 28h lets the idle engine write out the trace.                   */
+  memset(&rq->r_media_check, 0, sizeof(rq->r_media_check));
+  rq->r_mc_media_desc = 0xF8;
+  issue(C_MEDIACHK, 0);
+  dos_interrupt(0x28);
+  for (lbn = (uint32_t)partition_offset; lbn < image_sectors; lbn++)
+    if (memcmp(card_sector(lbn), expected + (size_t)lbn * 512, 512)) differ++;
+  printf("cache: %lu hits, %lu misses; card: %lu single, %lu multi, %lu CMD12\n",
+         (unsigned long)cache_hits, (unsigned long)cache_misses,
+         (unsigned long)sd_stats.st_single_cmds, (unsigned long)sd_stats.st_multi_cmds,
+         (unsigned long)sd_stats.st_cmd12);
+  for (i = 0; i < LAT_XFER_ROWS; i++)
+    for (b = 0; b < LAT_BUCKETS; b++)
+      filed[(i & LAT_MISS) != 0] += sd_latency.lt_transfer[i][b];
+  printf("latency: %lu transfers filed as cache hits, %lu as misses\n",
+         (unsigned long)filed[0], (unsigned long)filed[1]);
+  if (filed[0] && !cache_slots && !shadow_max) {
+    printf("latency: no cache, yet requests were filed as hits\n");   /* Streams */
+    bad_sectors++;
+  }
+  if (card_timing.ru_sectors)
+    printf("flash: %lu RU merges, %lu AU switches\n",
+           (unsigned long)card_count.ru_merges, (unsigned long)card_count.au_switches);
+  printf("data: %lu bad transfers, %lu card sectors differ at the end\n",
+         (unsigned long)bad_sectors, (unsigned long)differ);
+
+  if (keep && !card_save(keep)) perror(keep);
+  card_close();
+  free(expected);
+  return (bad_sectors || differ) ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+/* image.c - a scratch card image for the simulator                    */
+/*                                                                      */
+/*   32MB: an MBR with one FAT16 partition at sector 2048, and that     */
+/* partition's boot sector.  1 reserved sector, two 62 sector FATs and  */
+/* 512 root entries put the data area at partition sector 157, with 4  */
+/* sectors per cluster.  The rest of the file is sparse zeros.          */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+int image_create (const char *name)
+{
+  static uint8_t s[512];
+  FILE *f = fopen(name, "wb");
+  const uint32_t total = 65536, start = 2048, size = total - start;
+
+  if (!f) return 0;
+  memset(s, 0, sizeof(s));
+  s[0x1BE] = 0x80;
+  s[0x1BE + 4] = 0x06;
+  memcpy(&s[0x1BE + 8], &start, 4);
+  memcpy(&s[0x1BE + 12], &size, 4);
+  s[510] = 0x55; s[511] = 0xAA;
+  fwrite(s, 1, 512, f);
+
+  memset(s, 0, sizeof(s));
+  memcpy(s, "\xEB\x3C\x90MSDOS5.0", 11);
+  s[11] = 0x00; s[12] = 0x02;    /* 512 bytes per sector */
+  s[13] = 4;                     /* Sectors per cluster */
+  s[14] = 1;                     /* Reserved sectors */
+  s[16] = 2;                     /* FATs */
+  s[17] = 0x00; s[18] = 0x02;    /* 512 root entries */
+  s[19] = (uint8_t)size; s[20] = (uint8_t)(size >> 8);
+  s[21] = 0xF8;
+  s[22] = 62;                    /* Sectors per FAT */
+  s[38] = 0x29;
+  memcpy(&s[54], "FAT16   ", 8);
+  s[510] = 0x55; s[511] = 0xAA;
+  fseek(f, start * 512L, SEEK_SET);
+  fwrite(s, 1, 512, f);
+  fseek(f, total * 512L - 1, SEEK_SET);
+  fputc(0, f);
+  return fclose(f) == 0;
+}
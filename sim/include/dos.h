@@ -0,0 +1 @@
+/* dos.h - empty on the host, see simhost.h */
@@ -0,0 +1 @@
+/* i86.h - empty on the host, see simhost.h */
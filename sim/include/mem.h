@@ -0,0 +1 @@
+/* mem.h - empty on the host, see simhost.h */
@@ -0,0 +1,355 @@
+/* sdbench.c - run sdmm.c against the simulated VIA and card            */
+/*                                                                      */
+/*   Usage:  sdbench [-w n] [-s n] [-c] [-v] image                      */
+/*                                                                      */
+/*   Brings the card up the way the driver does at boot (sd_initialize) */
+/* and then times single-sector, 16-sector and sequential reads and     */
+/* writes, reporting the port reads, port writes, SCLK edges and ticks  */
+/* (VIA accesses plus delay loops, roughly microseconds) they cost per  */
+/* sector.  Every sector read is checked against the image and every    */
+/* sector written is read back, and sd_flush() has to leave the card    */
+/* idle after a lone CMD24 as well as a CMD25.  Then the transmit paths */
+/* are timed on their own, with an estimate of the C loops' CPU time:   */
+/* the loop xmit_mmc() had before it was made table-driven, and         */
+/* xmit_mmc() now at the old bit delay and at none, which is where      */
+/* sdbench-asm runs the kernel instead of the C loop.                   */
+/* -w picks one wiring (0 bit-banging, 1 shift register, 2 CA2; default */
+/* all three), -s fixes the bit delay like /S=n, -c creates a 32MB      */
+/* FAT16 image if the file does not exist and -v turns on the driver's  */
+/* debug output.  The image file itself is never modified.  Built as    */
+/* sdbench-asm (USE_ASM_SPI) the driver's inline-assembly kernels run   */
+/* instead of the C loops, through asm86.c, and a run where calibration */
+/* had to fall back to the C loops fails.                               */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "sd.h"
+#include "diskio.h"
+#include "stats.h"
+#include "sim.h"
+
+/* What the rest of the driver would provide */
+bool debug = false;
+bool initNeeded = false;
+SdStats sd_stats;
+
+void cdprintf (char *msg, ...)
+{
+  va_list ap;
+
+  va_start(ap, msg);
+  vprintf(msg, ap);
+  va_end(ap);
+}
+
+/* sdmm.c settings, as set by /S=n and /W=n */
+extern uint16_t bit_delay_us;
+extern bool bit_delay_fixed;
+extern uint8_t spi_wiring;
+
+typedef struct {
+  const char *name;
+  int write;
+  uint16_t count;            /* Sectors per request */
+  uint16_t requests;
+  uint32_t stride;           /* Sectors from one request to the next */
+} Scenario;
+
+static const Scenario scenarios[] = {
+  { "read 1, scattered",    0,  1,  64,  37 },
+  { "read 16, scattered",   0, 16,   8,  97 },
+  { "read 1, sequential",   0,  1, 128,   1 },
+  { "write 1, scattered",   1,  1,  64,  37 },
+  { "write 16, scattered",  1, 16,   8,  97 },
+  { "write 1, sequential",  1,  1, 128,   1 },
+};
+
+#define NSCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+#define READ_BASE   4096UL
+#define WRITE_BASE  8192UL
+#define WRITE_AREA  4096UL
+
+static const char *wiring_names[] = { "bit-bang", "shift register", "CA2" };
+
+static uint8_t buffer[16 * 512];
+
+static void pattern (uint8_t *p, uint32_t lba, int pass)
+{
+  int i;
+
+  for (i = 0; i < 512; i++) p[i] = (uint8_t)(lba * 7 + i * 3 + pass);
+}
+
+/* Partition LBA -> image sector */
+static uint8_t *image_sector (uint32_t lba)
+{
+  return card_sector(lba + partition_offset);
+}
+
+/* Run one scenario, returns the number of bad sectors */
+static int run (const Scenario *sc, uint32_t base, int pass)
+{
+  SimCounters before = sim_count;
+  uint32_t ticks = sim_ticks;
+  uint32_t lba, sectors = (uint32_t)sc->count * sc->requests;
+  int i, j, bad = 0;
+
+  for (i = 0; i < sc->requests; i++) {
+    lba = base + i * sc->stride;
+    if (sc->write) {
+      for (j = 0; j < sc->count; j++) pattern(buffer + j * 512, lba + j, pass);
+      if (sd_write(0, lba, buffer, sc->count) != RES_OK) bad += sc->count;
+    } else {
+      memset(buffer, 0, sizeof(buffer));
+      if (sd_read(0, lba, buffer, sc->count) != RES_OK) bad += sc->count;
+      else for (j = 0; j < sc->count; j++)
+        if (memcmp(buffer + j * 512, image_sector(lba + j), 512)) bad++;
+    }
+  }
+  if (sc->write && sd_flush(0) != RES_OK) bad++;
+
+  printf("  %-20s %6lu %9.1f %9.1f %9.1f %9.1f  %s\n", sc->name,
+         (unsigned long)sectors,
+         (double)(sim_count.port_reads - before.port_reads) / sectors,
+         (double)(sim_count.port_writes - before.port_writes) / sectors,
+         (double)(sim_count.sclk_edges - before.sclk_edges) / sectors,
+         (double)(sim_ticks - ticks) / sectors,
+         bad ? "FAILED" : "ok");
+
+  /* Read what was written back through the driver */
+  if (sc->write) {
+    for (i = 0; i < sc->requests; i++) {
+      lba = base + i * sc->stride;
+      for (j = 0; j < sc->count; j++) {
+        pattern(buffer + 512, lba + j, pass);
+        if (memcmp(image_sector(lba + j), buffer + 512, 512)
+            || sd_read(0, lba + j, buffer, 1) != RES_OK
+            || memcmp(buffer, buffer + 512, 512)) {
+          printf("    sector %lu did not read back\n", (unsigned long)(lba + j));
+          bad++;
+        }
+      }
+    }
+  }
+  return bad;
+}
+
+/* sd_flush() has to wait out the card's programming whether the last */
+/* write was a CMD25 it closes itself or a lone CMD24 that left nothing */
+/* open, since DOS counts on the data being on the card after it.       */
+static int flush_check (void)
+{
+  uint32_t lba = WRITE_BASE + NSCENARIOS * WRITE_AREA;
+  uint16_t count;
+  int bad = 0;
+
+  memset(buffer, 0x5A, 2 * 512);
+  for (count = 1; count <= 2; count++, lba += 16) {
+    if (sd_write(0, lba, buffer, count) != RES_OK || sd_flush(0) != RES_OK || card_busy()) {
+      printf("  sd_flush() after %s: card still busy, FAILED\n", count == 1 ? "CMD24" : "CMD25");
+      bad++;
+    }
+  }
+  return bad;
+}
+
+/* sdmm.c's transmit paths, for the rows below */
+void outportbyte (volatile uint8_t far *port, uint8_t value);
+void sim_xmit_mmc (const uint8_t far *buff, uint16_t bc);
+
+#define XMIT_SECTORS 16
+
+/* xmit_mmc() as it was before the table-driven loop and the kernel:   */
+/* a branch per bit and an outportbyte() call per edge, at the fixed   */
+/* bit delay of 2 it had then.                                          */
+#define OLD_BIT(d, m) \
+  if ((d) & (m)) { outportbyte(NULL, 0x01); sim_delay(2); outportbyte(NULL, 0x03); sim_delay(2); } \
+  else           { outportbyte(NULL, 0x00); sim_delay(2); outportbyte(NULL, 0x02); sim_delay(2); }
+
+static void xmit_old (const uint8_t *buff, uint16_t bc)
+{
+  uint8_t d;
+
+  do {
+    d = *buff++;
+    OLD_BIT(d, 0x80) OLD_BIT(d, 0x40) OLD_BIT(d, 0x20) OLD_BIT(d, 0x10)
+    OLD_BIT(d, 0x08) OLD_BIT(d, 0x04) OLD_BIT(d, 0x02) OLD_BIT(d, 0x01)
+  } while (--bc);
+  outportbyte(NULL, 0x01);
+}
+
+/* The tick model charges only VIA accesses and delay loops, so the C  */
+/* loops' own instructions have to be added here.  These are 8088      */
+/* clocks counted from what each loop has to execute (register forms,  */
+/* memory operands at 4 clocks a byte on the 8-bit bus), not measured: */
+/*   old loop, per bit: test and branch on the bit (12), two far calls  */
+/*     of outportbyte() with three word arguments, its prologue, the    */
+/*     via_initialized test, LES of via1, the store, epilogue, RETF and */
+/*     stack fix-up (240 each), two near calls of delay_us() (60 each)  */
+/*   table loop, per bit: shift the bit out of d (26), two table loads */
+/*     and two stores through the far port pointer (80), two tests of  */
+/*     bit_delay_us (80), and the two delay_us() calls when it is set   */
+/*   CA2 loop, per bit: shift, one table load, one store (70)           */
+/*   any loop, per byte: far pointer fetch, count and branch (50)       */
+/* The asm kernel needs none of this: asm86.c counts its clocks.       */
+#define CPU_OLD_BIT    (12 + 2 * 240 + 2 * 60)
+#define CPU_TABLE_BIT  (26 + 80 + 80)
+#define CPU_DELAY      (2 * 60)
+#define CPU_CA2_BIT    70
+#define CPU_BYTE       50
+
+/* Time XMIT_SECTORS data blocks through one transmit path.  The bytes */
+/* all have bit 7 set, so the card never takes them for a command.     */
+/* ticks are the simulator's (VIA accesses and delay loops, plus the   */
+/* kernel's own clocks when it ran), cpu is the clocks above or the    */
+/* kernel's, and us is the two together at 5MHz.                        */
+static void xmit_row (const char *name, int old, uint16_t delay, uint16_t cpu_bit)
+{
+  SimCounters before;
+  uint32_t ticks, clocks = asm_clocks, cpu, us;
+  uint16_t saved = bit_delay_us;
+  int i;
+
+  memset(buffer, 0xA5, 512);
+  bit_delay_us = delay;
+  before = sim_count;
+  ticks = sim_ticks;
+  for (i = 0; i < XMIT_SECTORS; i++) {
+    if (old) xmit_old(buffer, 512);
+    else sim_xmit_mmc(buffer, 512);
+  }
+  bit_delay_us = saved;
+  ticks = (sim_ticks - ticks + XMIT_SECTORS / 2) / XMIT_SECTORS;
+  if (asm_clocks != clocks) {
+    cpu = (asm_clocks - clocks) / XMIT_SECTORS;
+    us = ticks;                /* asm86.c has already added the clocks */
+  } else {
+    cpu = 512UL * (8UL * cpu_bit + CPU_BYTE);
+    us = ticks + cpu / 5;
+  }
+  printf("  %-26s %9.1f %9.1f %9lu %9lu%s %9lu %9.1f\n", name,
+         (double)(sim_count.port_writes - before.port_writes) / XMIT_SECTORS,
+         (double)(sim_count.sclk_edges - before.sclk_edges) / XMIT_SECTORS,
+         (unsigned long)ticks, (unsigned long)cpu, asm_clocks != clocks ? " asm" : " est",
+         (unsigned long)us, 1e6 / us);
+}
+
+/* The transmit paths side by side, on 512 byte data blocks */
+static void xmit_rows (int wiring)
+{
+  printf("  %-26s %9s %9s %9s %13s %9s %9s\n", "transmit, per sector:", "writes", "edges",
+         "ticks", "cpu clocks", "us", "sect/s");
+  if (wiring == WIRE_CA2) {
+    xmit_row("xmit_mmc (CA2)", 0, 0, CPU_CA2_BIT);
+  } else {
+    xmit_row("old loop, delay 2", 1, 2, CPU_OLD_BIT);
+    xmit_row("xmit_mmc, delay 2", 0, 2, CPU_TABLE_BIT + CPU_DELAY);
+    xmit_row("xmit_mmc, delay 0", 0, 0, CPU_TABLE_BIT);
+  }
+  disk_initialize(0);        /* The card saw junk, start it afresh */
+}
+
+static int bench (int wiring, int first)
+{
+  bpb volume;
+  SimCounters before = sim_count;
+  uint32_t ticks = sim_ticks;
+  int ok, bad = 0;
+  unsigned s;
+#ifdef USE_ASM_SPI
+  uint32_t clocks;
+#endif
+
+  spi_wiring = (uint8_t)wiring;
+  via_wiring(wiring);
+  memset(&sd_stats, 0, sizeof(sd_stats));
+  if (first) ok = sd_initialize(0, 0, &volume);
+  else ok = !(disk_initialize(0) & STA_NOINIT);
+
+  printf("Wiring %d (%s): ", wiring, wiring_names[wiring]);
+  if (!ok) {
+    printf("card not initialized\n");
+    return 1;
+  }
+  printf("bit delay %u, partition at %lu, init took %lu port accesses, %lu ticks\n",
+         bit_delay_us, (unsigned long)partition_offset,
+         (unsigned long)(sim_count.port_reads - before.port_reads
+                         + sim_count.port_writes - before.port_writes),
+         (unsigned long)(sim_ticks - ticks));
+  printf("  %-20s %6s %9s %9s %9s %9s\n", "per sector:", "sectors",
+         "reads", "writes", "edges", "ticks");
+
+  before = sim_count;
+#ifdef USE_ASM_SPI
+  clocks = asm_clocks;
+#endif
+  for (s = 0; s < NSCENARIOS; s++)
+    bad += run(&scenarios[s], scenarios[s].write ? WRITE_BASE + s * WRITE_AREA : READ_BASE,
+               wiring);
+  bad += flush_check();
+  if (wiring == WIRE_SHIFTREG && sim_count.shift_bytes == before.shift_bytes)
+    printf("  (shift register probe failed, received by bit-banging)\n");
+#ifdef USE_ASM_SPI
+  /* Calibration falls back to a bit delay, and so to the C loops, if */
+  /* the kernels get it wrong; that must not pass as a good run.       */
+  if (wiring != WIRE_CA2) {
+    if (asm_clocks == clocks) {
+      printf("  asm kernels not used, FAILED\n");
+      bad++;
+    } else {
+      printf("  asm kernels: %lu 8088 clocks\n", (unsigned long)(asm_clocks - clocks));
+    }
+  }
+#endif
+  printf("  commands: %lu single, %lu multi, %lu CMD12; busy polls %lu, token polls %lu\n",
+         (unsigned long)sd_stats.st_single_cmds, (unsigned long)sd_stats.st_multi_cmds,
+         (unsigned long)sd_stats.st_cmd12, (unsigned long)sd_stats.st_ready_spins,
+         (unsigned long)sd_stats.st_token_spins);
+  xmit_rows(wiring);
+  return bad;
+}
+
+int main (int argc, char *argv[])
+{
+  const char *image = NULL;
+  int wiring = -1, create = 0, bad = 0, w, i;
+  uint32_t sectors;
+  FILE *f;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-w") && i + 1 < argc) wiring = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      bit_delay_us = (uint16_t)atoi(argv[++i]);
+      bit_delay_fixed = true;
+    }
+    else if (!strcmp(argv[i], "-c")) create = 1;
+    else if (!strcmp(argv[i], "-v")) debug = true;
+    else if (argv[i][0] != '-' && !image) image = argv[i];
+    else image = NULL, i = argc;
+  }
+  if (!image || wiring > WIRE_CA2) {
+    fprintf(stderr, "Usage: sdbench [-w 0|1|2] [-s delay] [-c] [-v] image\n");
+    return 2;
+  }
+  if (create && (f = fopen(image, "rb")) == NULL) {
+    if (!image_create(image)) {
+      perror(image);
+      return 2;
+    }
+  } else if (create) fclose(f);
+  if (!card_open(image, &sectors)) {
+    perror(image);
+    return 2;
+  }
+  printf("%s: %lu sectors\n", image, (unsigned long)sectors);
+
+  for (w = WIRE_BITBANG; w <= WIRE_CA2; w++)
+    if (wiring < 0 || wiring == w) {
+      bad += bench(w, wiring < 0 ? w == WIRE_BITBANG : 1);
+    }
+  card_close();
+  return bad ? 1 : 0;
+}
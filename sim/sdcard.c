@@ -0,0 +1,413 @@
+/* sdcard.c - an SDHC card in SPI mode, backed by an image file         */
+/*                                                                      */
+/*   Works a bit at a time off the SCLK edges the VIA model reports:    */
+/* MOSI is sampled on the rising edge, MISO changes on the falling one. */
+/* Whole bytes go through a command/data state machine whose replies   */
+/* wait in an output queue; with nothing queued the card sends 0xFF,   */
+/* or 0x00 while it is still programming a written block.  The image   */
+/* is mapped copy-on-write, so writes never reach the file.  Every data */
+/* block taken is logged, and card_power_cut() can make the card go     */
+/* dead right after a chosen one.                                       */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sim.h"
+
+CardTiming card_timing = {
+  2,       /* acmd41_busy */
+  4,       /* nac_bytes */
+  2000,    /* program_ticks */
+  1,       /* cmd23 */
+  0, 0, 0, 0 /* flash model off */
+};
+
+CardCounters card_count;
+uint32_t card_write_lba[CARD_WRITE_LOG];
+uint32_t card_writes;
+
+#define NO_RU  0xFFFFFFFFUL
+
+#define R1_IDLE        0x01
+#define R1_ILLEGAL     0x04
+#define R1_PARAM       0x40
+
+#define TOKEN_SINGLE   0xFE      /* Read data, CMD24 write data */
+#define TOKEN_MULTI    0xFC      /* CMD25 write data */
+#define TOKEN_STOP     0xFD      /* CMD25 stop */
+#define DATA_ACCEPTED  0x05
+#define DATA_WR_ERROR  0x0D
+
+#define STATE_CMD       0        /* Waiting for or receiving a command */
+#define STATE_READ      1        /* CMD18 running */
+#define STATE_WR_TOKEN  2        /* CMD24/CMD25 waiting for a data token */
+#define STATE_WR_DATA   3        /* Receiving 512 data + 2 CRC bytes */
+
+static struct {
+  uint8_t *image;
+  size_t size;
+  uint32_t sectors;
+
+  int selected;
+  int sclk;
+  uint8_t rx, tx;
+  int rx_bits;
+
+  uint8_t queue[1024];
+  int head, tail;
+  uint32_t busy_until;       /* sim_ticks when programming ends */
+
+  int state;
+  int idle, app, acmd41_left;
+  uint8_t cmd[6];
+  int cmd_len;
+  uint32_t read_next;
+  uint32_t read_left;        /* CMD23 count for CMD18, 0 = open ended */
+  uint32_t set_count;        /* Last CMD23 argument, consumed by CMD18 */
+  uint32_t write_next;
+  int write_multi;
+  uint8_t wbuf[514];
+  int wlen;
+
+  uint32_t ru_open;          /* RU being written, NO_RU if none */
+  uint32_t ru_next;          /* Sector that would continue it */
+  uint32_t au_open[2];       /* AUs written last, most recent first */
+
+  long cut_left;             /* Blocks until the power goes, -1 never */
+  int dead;                  /* It went */
+} card;
+
+void card_flash (void)
+{
+  card_timing.ru_sectors = 32;
+  card_timing.au_sectors = 8192;
+  card_timing.merge_ticks = 3000;
+  card_timing.au_ticks = 20000;
+}
+
+int card_busy (void)
+{
+  return sim_ticks < card.busy_until;
+}
+
+int card_write_open (void)
+{
+  return card.state == STATE_WR_TOKEN && card.write_multi;
+}
+
+void card_power_cut (long n)
+{
+  card.cut_left = n;
+  card.dead = (n == 0);
+}
+
+uint8_t *card_sector (uint32_t lba)
+{
+  return card.image + (size_t)lba * 512;
+}
+
+int card_open (const char *image, uint32_t *sectors)
+{
+  struct stat st;
+  int fd = open(image, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 512) {
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  card.size = (size_t)st.st_size;
+  card.image = mmap(NULL, card.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (card.image == MAP_FAILED) {
+    card.image = NULL;
+    return 0;
+  }
+  card.sectors = (uint32_t)(card.size / 512);
+  card.idle = 1;
+  card.acmd41_left = card_timing.acmd41_busy;
+  card.ru_open = card.au_open[0] = card.au_open[1] = NO_RU;
+  card.cut_left = -1;
+  *sectors = card.sectors;
+  return 1;
+}
+
+void card_close (void)
+{
+  if (card.image) munmap(card.image, card.size);
+  card.image = NULL;
+}
+
+int card_save (const char *name)
+{
+  FILE *f = fopen(name, "wb");
+  int ok;
+
+  if (!f) return 0;
+  ok = (fwrite(card.image, 512, card.sectors, f) == card.sectors);
+  return (fclose(f) == 0) && ok;
+}
+
+static void put (uint8_t b)
+{
+  if (card.tail < (int)sizeof(card.queue)) card.queue[card.tail++] = b;
+}
+
+static void put_r1 (uint8_t r1)
+{
+  put(0xFF);                 /* Ncr */
+  put(r1 | (card.idle ? R1_IDLE : 0));
+}
+
+static void put_block (const uint8_t *data, int len)
+{
+  int i;
+
+  for (i = 0; i < card_timing.nac_bytes; i++) put(0xFF);
+  put(TOKEN_SINGLE);
+  for (i = 0; i < len; i++) put(data[i]);
+  put(0xFF);                 /* CRC, not checked in SPI mode */
+  put(0xFF);
+}
+
+/* The next byte to shift out */
+static uint8_t next_out (void)
+{
+  if (card.head == card.tail) {
+    card.head = card.tail = 0;
+    if (card.state == STATE_READ) {
+      put_block(card_sector(card.read_next++), 512);
+      if (card.read_left && !--card.read_left) card.state = STATE_CMD;
+    }
+  }
+  if (card.head < card.tail) return card.queue[card.head++];
+  return (sim_ticks < card.busy_until) ? 0x00 : 0xFF;
+}
+
+static void put_csd (void)
+{
+  uint8_t csd[16] = { 0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0, 0, 0,
+                      0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01 };
+  uint32_t c_size = card.sectors / 1024 - 1;
+
+  csd[7] = (uint8_t)((c_size >> 16) & 0x3F);
+  csd[8] = (uint8_t)(c_size >> 8);
+  csd[9] = (uint8_t)c_size;
+  put_block(csd, 16);
+}
+
+static void command (void)
+{
+  uint8_t index = card.cmd[0] & 0x3F;
+  uint32_t arg = ((uint32_t)card.cmd[1] << 24) | ((uint32_t)card.cmd[2] << 16)
+               | ((uint32_t)card.cmd[3] << 8) | card.cmd[4];
+  int app = card.app;
+  uint8_t scr[8] = { 0x02, 0x35, 0x80, 0x00, 0, 0, 0, 0 };
+
+  card.app = 0;
+  if (card.state == STATE_READ) {
+    if (index != 12 && index != 0) return;  /* Only these stop a CMD18 */
+    card.head = card.tail = 0;
+  }
+
+  switch (index) {
+  case 0:                    /* GO_IDLE_STATE, drops anything unsent */
+    card.head = card.tail = 0;
+    card.idle = 1;
+    card.acmd41_left = card_timing.acmd41_busy;
+    card.state = STATE_CMD;
+    put_r1(0);
+    break;
+  case 8:                    /* SEND_IF_COND: echo voltage and pattern */
+    put_r1(0);
+    put(0x00); put(0x00); put((uint8_t)(arg >> 8) & 0x0F); put((uint8_t)arg);
+    break;
+  case 55:                   /* APP_CMD */
+    card.app = 1;
+    put_r1(0);
+    break;
+  case 41:                   /* SD_SEND_OP_COND, only as an ACMD */
+    if (!app) { put_r1(R1_ILLEGAL); break; }
+    if (card.acmd41_left > 0) card.acmd41_left--;
+    else card.idle = 0;
+    put_r1(0);
+    break;
+  case 58:                   /* READ_OCR: powered up, CCS (block addressing) */
+    put_r1(0);
+    put(0xC0); put(0xFF); put(0x80); put(0x00);
+    break;
+  case 16:                   /* SET_BLOCKLEN */
+    put_r1(arg == 512 ? 0 : R1_PARAM);
+    break;
+  case 9:                    /* SEND_CSD */
+    put_r1(0);
+    put_csd();
+    break;
+  case 13:                   /* SEND_STATUS (R2) */
+    put_r1(0);
+    put(0x00);
+    break;
+  case 51:                   /* SEND_SCR */
+    if (!app) { put_r1(R1_ILLEGAL); break; }
+    if (card_timing.cmd23) scr[3] |= 0x02;
+    put_r1(0);
+    put_block(scr, 8);
+    break;
+  case 12:                   /* STOP_TRANSMISSION: stuff byte, R1b */
+    card.state = STATE_CMD;
+    put(0xFF);
+    put(card.idle ? R1_IDLE : 0);
+    card.busy_until = sim_ticks + 64;
+    break;
+  case 23:                   /* SET_BLOCK_COUNT */
+    card.set_count = arg;
+    put_r1(0);
+    break;
+  case 17:                   /* READ_SINGLE_BLOCK */
+  case 18:                   /* READ_MULTIPLE_BLOCK */
+    if (card.idle || arg >= card.sectors) { put_r1(R1_PARAM); break; }
+    put_r1(0);
+    if (index == 17) {
+      put_block(card_sector(arg), 512);
+    } else {
+      card.state = STATE_READ;
+      card.read_next = arg;
+      card.read_left = card.set_count;
+    }
+    card.set_count = 0;
+    break;
+  case 24:                   /* WRITE_BLOCK */
+  case 25:                   /* WRITE_MULTIPLE_BLOCK */
+    if (card.idle || arg >= card.sectors) { put_r1(R1_PARAM); break; }
+    put_r1(0);
+    card.state = STATE_WR_TOKEN;
+    card.write_next = arg;
+    card.write_multi = (index == 25);
+    card.set_count = 0;
+    break;
+  default:
+    put_r1(R1_ILLEGAL);
+    break;
+  }
+}
+
+/* Busy time for programming the block at lba, with the flash model */
+/* charging for RUs left or entered part way and for AU switches.    */
+static uint32_t program_time (uint32_t lba)
+{
+  uint32_t ticks = card_timing.program_ticks;
+  uint32_t ru, au;
+
+  if (!card_timing.ru_sectors) return ticks;
+  ru = lba / card_timing.ru_sectors;
+  if (ru == card.ru_open && lba == card.ru_next) {
+    card.ru_next++;
+    return ticks;
+  }
+  /* Leaving the open RU short of its end, or rewriting inside it */
+  if (card.ru_open != NO_RU && card.ru_next % card_timing.ru_sectors) {
+    ticks += card_timing.merge_ticks;
+    card_count.ru_merges++;
+  }
+  /* Entering this one part way */
+  if (lba % card_timing.ru_sectors) {
+    ticks += card_timing.merge_ticks;
+    card_count.ru_merges++;
+  }
+  au = lba / card_timing.au_sectors;
+  if (au != card.au_open[0]) {
+    if (au != card.au_open[1] && card.au_open[1] != NO_RU) {
+      ticks += card_timing.au_ticks;
+      card_count.au_switches++;
+    }
+    card.au_open[1] = card.au_open[0];
+    card.au_open[0] = au;
+  }
+  card.ru_open = ru;
+  card.ru_next = lba + 1;
+  return ticks;
+}
+
+/* A whole byte arrived on MOSI */
+static void byte_in (uint8_t b)
+{
+  switch (card.state) {
+  case STATE_WR_TOKEN:
+    if (b == TOKEN_STOP && card.write_multi) {
+      card.state = STATE_CMD;
+      put(0xFF);
+      card.busy_until = sim_ticks + card_timing.program_ticks / 4;
+    } else if (b == (card.write_multi ? TOKEN_MULTI : TOKEN_SINGLE)) {
+      card.state = STATE_WR_DATA;
+      card.wlen = 0;
+    }
+    return;
+
+  case STATE_WR_DATA:
+    card.wbuf[card.wlen++] = b;
+    if (card.wlen < (int)sizeof(card.wbuf)) return;
+    if (card.write_next >= card.sectors) {
+      put(DATA_WR_ERROR);
+      card.state = STATE_CMD;
+      return;
+    }
+    card.busy_until = sim_ticks + program_time(card.write_next);
+    if (card_writes < CARD_WRITE_LOG) card_write_lba[card_writes] = card.write_next;
+    card_writes++;
+    memcpy(card_sector(card.write_next++), card.wbuf, 512);
+    put(DATA_ACCEPTED);
+    if (card.cut_left > 0 && --card.cut_left == 0) card.dead = 1;
+    card.state = card.write_multi ? STATE_WR_TOKEN : STATE_CMD;
+    return;
+
+  default:
+    if (card.cmd_len == 0 && (b & 0xC0) != 0x40) return;
+    card.cmd[card.cmd_len++] = b;
+    if (card.cmd_len == 6) {
+      card.cmd_len = 0;
+      command();
+    }
+    return;
+  }
+}
+
+/* CS: a new selection restarts the bit count.  If SCLK idles high the */
+/* first falling edge brings out the first bit, otherwise it is out now */
+void card_select (int selected, int sclk)
+{
+  card.selected = selected;
+  card.sclk = sclk;
+  card.rx_bits = 0;
+  card.cmd_len = 0;
+  card.tx = 0xFF;
+  if (selected && !sclk) card.tx = next_out();
+}
+
+void card_sclk_rise (int mosi)
+{
+  card.sclk = 1;
+  if (!card.selected || card.dead) return;
+  card.rx = (uint8_t)((card.rx << 1) | (mosi ? 1 : 0));
+  if (++card.rx_bits == 8) {
+    card.rx_bits = 0;
+    byte_in(card.rx);
+  }
+}
+
+void card_sclk_fall (void)
+{
+  card.sclk = 0;
+  if (!card.selected) return;
+  if (card.rx_bits == 0) card.tx = next_out();
+  else card.tx = (uint8_t)((card.tx << 1) | 1);
+}
+
+int card_miso (void)
+{
+  if (!card.selected || card.dead) return 1;   /* Pull-up on DO */
+  return (card.tx & 0x80) ? 1 : 0;
+}
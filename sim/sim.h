@@ -0,0 +1,85 @@
+/* sim.h - the simulated VIA and SD card behind sdmm.c                  */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdint.h>
+
+/* How SCLK reaches the card, as for the driver's /W=n */
+#define WIRE_BITBANG   0     /* PA1 only */
+#define WIRE_SHIFTREG  1     /* PA1 AND CB1 */
+#define WIRE_CA2       2     /* CA2 */
+
+/* Virtual time: one tick per VIA access, about 1us on the Victor */
+extern uint32_t sim_ticks;
+
+/* What the driver did to the port */
+typedef struct {
+  uint32_t port_reads;
+  uint32_t port_writes;
+  uint32_t sclk_edges;       /* Both edges, so 16 per byte */
+  uint32_t shift_bytes;      /* Bytes clocked in by the shift register */
+} SimCounters;
+
+extern SimCounters sim_count;
+
+void via_wiring (int wiring);
+
+/* Card timing, in ticks unless noted */
+typedef struct {
+  int acmd41_busy;           /* ACMD41 calls answered "idle" before ready */
+  int nac_bytes;             /* 0xFF bytes before a read data token */
+  uint32_t program_ticks;    /* Busy after a write data packet */
+  int cmd23;                 /* Report CMD23 support in the SCR */
+
+  /* Flash layout, 0 ru_sectors for a flat program_ticks per block.  */
+  /* A write that starts or stops inside a recording unit (RU) costs */
+  /* a read-modify-write of it, and one outside the two allocation   */
+  /* units (AU) written last, which the card keeps open, costs an AU */
+  /* switch.                                                         */
+  uint32_t ru_sectors;
+  uint32_t au_sectors;
+  uint32_t merge_ticks;      /* RU read-modify-write */
+  uint32_t au_ticks;         /* Moving to another AU */
+} CardTiming;
+
+extern CardTiming card_timing;
+
+/* What the flash model charged for */
+typedef struct {
+  uint32_t ru_merges;
+  uint32_t au_switches;
+} CardCounters;
+
+extern CardCounters card_count;
+
+/* Turn the flash model on: 16K RUs in 4M AUs */
+void card_flash (void);
+
+/* Every data block the card took, CMD24 or CMD25, in order */
+#define CARD_WRITE_LOG 1024
+extern uint32_t card_write_lba[CARD_WRITE_LOG];
+extern uint32_t card_writes;
+
+/* Cut the power once n more data blocks have been taken, -1 never.   */
+/* The block that used up n is on the card; after it the card answers */
+/* nothing and stores nothing.                                         */
+void card_power_cut (long n);
+
+/* Create the scratch FAT16 image (image.c) */
+int image_create (const char *name);
+
+int card_open (const char *image, uint32_t *sectors);
+void card_close (void);
+int card_save (const char *name);    /* Write what the card holds to a file */
+uint8_t *card_sector (uint32_t lba);
+int card_busy (void);                /* Still programming a block */
+int card_write_open (void);          /* A CMD25 waits for more blocks */
+
+/* SPI side, called by the VIA model */
+void card_select (int selected, int sclk);
+void card_sclk_rise (int mosi);
+void card_sclk_fall (void);
+int card_miso (void);
+
+#endif
@@ -0,0 +1,55 @@
+/* simhost.h - host (Linux) build environment for sdmm.c and sd.c      */
+/*                                                                      */
+/*   Forced in front of every driver source with "gcc -include", and    */
+/* included again by sdmm.c for VIA_RD()/VIA_WR().  Far pointers become */
+/* flat ones into sim_mem, a 1MB image of the Victor's address space,   */
+/* so the driver's MK_FP(0xE800, 0x20) lands on the simulated VIA1.     */
+
+#ifndef _SIMHOST_H
+#define _SIMHOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define far
+#define __far
+#define near
+#define __near
+#define _interrupt
+#define __interrupt
+#define __segment uint16_t
+
+extern uint8_t sim_mem[0x100000];
+
+#define MK_FP(s,o)  ((void *)&sim_mem[((((uint32_t)(s)) << 4) + (uint16_t)(o)) & 0xFFFFF])
+#define FP_SEG(p)   ((uint16_t)(((const uint8_t *)(p) - sim_mem) >> 4))
+#define FP_OFF(p)   ((uint16_t)(((const uint8_t *)(p) - sim_mem) & 0x0F))
+
+#define _fmemcpy    memcpy
+#define _fmemset    memset
+#define _fmemcmp    memcmp
+
+struct SREGS { uint16_t es, cs, ss, ds; };
+
+/* Interrupt vectors (dosenv.c) */
+typedef void (*sim_vector_t)();
+sim_vector_t _dos_getvect (unsigned vector);
+void _dos_setvect (unsigned vector, sim_vector_t handler);
+void _chain_intr (sim_vector_t handler);
+
+/* The simulated 6522s (via6522.c) */
+uint8_t sim_via_read (volatile uint8_t *reg);
+void sim_via_write (volatile uint8_t *reg, uint8_t value);
+void sim_delay (unsigned int loops);
+
+#define VIA_RD(p)      sim_via_read((volatile uint8_t *)(p))
+#define VIA_WR(p, v)   sim_via_write((volatile uint8_t *)(p), (uint8_t)(v))
+#define delay_us(n)    sim_delay(n)
+
+/* The USE_ASM_SPI kernels, interpreted from sdmm.c's text (asm86.c) */
+extern uint32_t asm_clocks;
+void sim_asm_kernel (const char *name, uint8_t *buff, uint16_t bc);
+
+#endif
@@ -0,0 +1,226 @@
+/* via6522.c - the parts of the Victor's VIA1 that sdmm.c uses          */
+/*                                                                      */
+/*   Port A drives MOSI (PA0), SCLK (PA1) and CS (PA2), port B bit 7    */
+/* reads MISO.  Depending on the wiring SCLK also comes from CB1 while  */
+/* the shift register runs, or from CA2 pulsed by every write to ORA.   */
+/* Timer 2 counts down in virtual ticks.  Every other register in the   */
+/* Victor's address space, VIA2 included, is plain memory in sim_mem.   */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sim.h"
+
+uint8_t sim_mem[0x100000];
+uint32_t sim_ticks;
+SimCounters sim_count;
+
+#define VIA1_BASE   0xE8020UL
+
+/* Register offsets, as in V9kParallelPort */
+#define R_ORB       0x0
+#define R_ORA       0x1
+#define R_DDRB      0x2
+#define R_DDRA      0x3
+#define R_T2CL      0x8
+#define R_T2CH      0x9
+#define R_SR        0xA
+#define R_ACR       0xB
+#define R_PCR       0xC
+#define R_IFR       0xD
+#define R_IER       0xE
+#define R_ORA_NH    0xF
+
+#define PA_MOSI     0x01
+#define PA_SCLK     0x02
+#define PA_CS       0x04
+#define PB_MISO     0x80
+
+#define ACR_SR_MASK     0x1C
+#define ACR_SR_IN_PHI2  0x08
+#define ACR_T2_PULSES   0x20
+#define PCR_CA2_MASK    0x0E
+#define PCR_CA2_PULSE   0x0A
+#define IFR_SR          0x04
+#define IFR_T2          0x20
+
+static struct {
+  uint8_t ora, ddra, acr, pcr, ifr, sr;
+  uint16_t t2_count;         /* Loaded when T2CH is written... */
+  uint32_t t2_start;         /* ... at this tick */
+  int sclk;                  /* SCLK level at the card */
+  int cs;                    /* CS line level (1 = deselected) */
+} via = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static int wiring;
+
+/* Rewire SCLK.  The line just takes its new level, and the card starts */
+/* counting bits afresh, as if it had been deselected in between.       */
+void via_wiring (int w)
+{
+  uint8_t pa = (via.ora & via.ddra) | (uint8_t)~via.ddra;
+
+  wiring = w;
+  via.sclk = (wiring == WIRE_CA2) ? 1 : ((pa & PA_SCLK) ? 1 : 0);
+  card_select(!via.cs, via.sclk);
+}
+
+void sim_delay (unsigned int loops)
+{
+  /* delay_us() is a LOOP instruction, 17 clocks at 5MHz */
+  sim_ticks += (loops * 17UL) / 5;
+}
+
+/* Move the SCLK line, telling the card about edges */
+static void set_sclk (int level, int mosi)
+{
+  if (level == via.sclk) return;
+  via.sclk = level;
+  sim_count.sclk_edges++;
+  if (level) card_sclk_rise(mosi);
+  else card_sclk_fall();
+}
+
+/* Port A pins after a write; pins set as inputs float high */
+static void write_pa (uint8_t value, int handshake)
+{
+  uint8_t pa;
+  int cs, mosi;
+
+  via.ora = value;
+  pa = (value & via.ddra) | (uint8_t)~via.ddra;
+  mosi = (pa & PA_MOSI) ? 1 : 0;
+  cs = (pa & PA_CS) ? 1 : 0;
+  if (cs != via.cs) {
+    via.cs = cs;
+    card_select(!cs, via.sclk);
+  }
+  switch (wiring) {
+  case WIRE_CA2:
+    /* Pulse output mode: CA2 goes low for one cycle after ORA is written */
+    if (handshake && (via.pcr & PCR_CA2_MASK) == PCR_CA2_PULSE) {
+      set_sclk(0, mosi);
+      set_sclk(1, mosi);
+      sim_ticks++;
+    }
+    break;
+  default:
+    /* CB1 idles high between shifts, so the AND gate passes PA1 */
+    set_sclk((pa & PA_SCLK) ? 1 : 0, mosi);
+    break;
+  }
+}
+
+/* Shift-in under phi2: eight CB1 pulses, CB2 latched on each rising edge */
+static void shift_in (void)
+{
+  int i;
+  int pa1 = ((via.ora | ~via.ddra) & PA_SCLK) ? 1 : 0;
+
+  via.ifr &= ~IFR_SR;
+  for (i = 0; i < 8; i++) {
+    if (wiring == WIRE_SHIFTREG && pa1) set_sclk(0, 1);
+    via.sr = (uint8_t)((via.sr << 1) | (card_miso() ? 1 : 0));
+    if (wiring == WIRE_SHIFTREG && pa1) set_sclk(1, 1);
+  }
+  sim_ticks += 16;
+  sim_count.shift_bytes++;
+  via.ifr |= IFR_SR;
+}
+
+static uint16_t t2_value (void)
+{
+  uint32_t elapsed = sim_ticks - via.t2_start;
+
+  if (elapsed > via.t2_count) via.ifr |= IFR_T2;
+  return (uint16_t)(via.t2_count - elapsed);
+}
+
+uint8_t sim_via_read (volatile uint8_t *reg)
+{
+  uint32_t addr = (uint32_t)(reg - sim_mem);
+  uint8_t value;
+
+  sim_ticks++;
+  if (addr < VIA1_BASE || addr >= VIA1_BASE + 16) return *reg;
+
+  sim_count.port_reads++;
+  switch (addr - VIA1_BASE) {
+  case R_ORB:
+    return card_miso() ? PB_MISO : 0;
+  case R_ORA:
+  case R_ORA_NH:
+    return via.ora;
+  case R_DDRA:
+    return via.ddra;
+  case R_T2CL:
+    value = (uint8_t)t2_value();
+    via.ifr &= ~IFR_T2;
+    return value;
+  case R_T2CH:
+    return (uint8_t)(t2_value() >> 8);
+  case R_SR:
+    value = via.sr;
+    via.ifr &= ~IFR_SR;
+    if ((via.acr & ACR_SR_MASK) == ACR_SR_IN_PHI2) shift_in();
+    return value;
+  case R_ACR:
+    return via.acr;
+  case R_PCR:
+    return via.pcr;
+  case R_IFR:
+    t2_value();
+    return via.ifr;
+  default:
+    return *reg;
+  }
+}
+
+void sim_via_write (volatile uint8_t *reg, uint8_t value)
+{
+  uint32_t addr = (uint32_t)(reg - sim_mem);
+
+  sim_ticks++;
+  if (addr < VIA1_BASE || addr >= VIA1_BASE + 16) {
+    *reg = value;
+    return;
+  }
+
+  sim_count.port_writes++;
+  switch (addr - VIA1_BASE) {
+  case R_ORA:
+    write_pa(value, 1);
+    break;
+  case R_ORA_NH:
+    write_pa(value, 0);
+    break;
+  case R_DDRA:
+    via.ddra = value;
+    write_pa(via.ora, 0);
+    break;
+  case R_T2CL:
+    via.t2_count = (via.t2_count & 0xFF00) | value;
+    break;
+  case R_T2CH:
+    via.t2_count = (uint16_t)((value << 8) | (via.t2_count & 0xFF));
+    via.t2_start = sim_ticks;
+    via.ifr &= ~IFR_T2;
+    break;
+  case R_SR:
+    via.sr = value;
+    via.ifr &= ~IFR_SR;
+    break;
+  case R_ACR:
+    via.acr = value;
+    break;
+  case R_PCR:
+    via.pcr = value;
+    break;
+  case R_IFR:
+    via.ifr &= ~value;
+    break;
+  default:
+    *reg = value;
+    break;
+  }
+}
@@ -0,0 +1,85 @@
+/* stats.h - driver operation counters, shared with the SDSTAT utility */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+/*
+ * IOCTL subfunctions (first byte of the IOCTL data block)
+ */
+#define GET_CACHE_STATS 0x80     /* IOCTL input: fill in an SdCacheStats block */
+#define GET_STATS       0x83     /* IOCTL input: fill in an SdStats block */
+#define RESET_STATS     0x84     /* IOCTL output: zero all counters */
+#define GET_LATENCY     0x85     /* IOCTL input: fill in an SdLatency block */
+
+#define STATS_COMMANDS  0x1A     /* Request command codes 0x00..0x19 */
+#define STATS_ERRORS    0x10     /* DOS error codes 0x00..0x0F */
+
+/* Latency buckets, in VIA timer 2 ticks (about 1us): bucket 0 is under   */
+/* 64 ticks, bucket b (1..10) is 2^(b+5) up to 2^(b+6), and the last one  */
+/* holds requests that outlasted the 16 bit timer (65ms or more).         */
+#define LAT_BUCKETS     12
+#define LAT_MIN_SHIFT   6
+
+/* Transfer rows: Input/Output requests split three ways */
+#define LAT_WRITE       0x04     /* Output or output with verify */
+#define LAT_MISS        0x02     /* Went to the card (not all from cache) */
+#define LAT_MULTI       0x01     /* More than one sector */
+#define LAT_XFER_ROWS   8
+
+#pragma pack(1)
+
+/* SD driver IOCTL Get_Cache_Stats() data structure */
+typedef struct {
+  uint8_t cs_ioctl_type;     /* GET_CACHE_STATS */
+  uint8_t cs_ioctl_status;   /* 0 if successful, 1 if error */
+  uint16_t cs_slots;         /* Number of cache slots, 0 if disabled */
+  uint32_t cs_hits;          /* Sectors read from the cache */
+  uint32_t cs_misses;        /* Sectors read from the card */
+  uint32_t cs_prefetched;    /* Sectors read ahead along the FAT chain */
+  uint32_t cs_prefetch_hits; /* Read-ahead sectors DOS then asked for */
+  uint32_t cs_prefetch_wasted; /* Read-ahead sectors evicted unused */
+  uint16_t cs_pinned;        /* Slots pinned by /R or PIN_SECTORS */
+} SdCacheStats;
+
+/* SD driver IOCTL Get_Stats() data structure.  All counters wrap at 2^32. */
+typedef struct {
+  uint8_t st_ioctl_type;     /* GET_STATS */
+  uint8_t st_ioctl_status;   /* 0 if successful, 1 if error */
+  uint32_t st_requests[STATS_COMMANDS];   /* Requests by command code */
+  uint32_t st_errors[STATS_ERRORS];       /* Failed requests by DOS error code */
+  uint32_t st_sectors_read;  /* Sectors DOS read */
+  uint32_t st_sectors_written; /* Sectors DOS wrote */
+  uint32_t st_single_cmds;   /* CMD17/CMD24 sent */
+  uint32_t st_multi_cmds;    /* CMD18/CMD25 sent */
+  uint32_t st_cmd12;         /* CMD12 STOP_TRANSMISSION sent */
+  uint32_t st_ready_spins;   /* wait_ready() polls that found the card busy */
+  uint32_t st_token_spins;   /* Polls for a data token that found none */
+  uint32_t st_reinits;       /* disk_initialize() calls */
+} SdStats;
+
+/* SD driver IOCTL Get_Latency() data structure */
+typedef struct {
+  uint8_t lt_ioctl_type;     /* GET_LATENCY */
+  uint8_t lt_ioctl_status;   /* 0 if successful, 1 if error */
+  uint32_t lt_command[STATS_COMMANDS][LAT_BUCKETS];   /* Every request, by command */
+  uint32_t lt_transfer[LAT_XFER_ROWS][LAT_BUCKETS];   /* Input/Output, by LAT_* row */
+  uint16_t lt_worst_ticks;   /* Slowest request seen, 0xFFFF if it ran out */
+  uint8_t lt_worst_command;  /* ... its command code */
+  uint16_t lt_worst_count;   /* ... its sector count (transfers only) */
+  uint32_t lt_worst_lbn;     /* ... its first sector (transfers only) */
+} SdLatency;
+
+#pragma pack()
+
+/* The driver's live counters (the two header bytes are unused there) */
+extern SdStats sd_stats;
+
+/* Request latency histograms, reset along with sd_stats */
+extern SdLatency sd_latency;
+
+#define STAT_INC(f)     (sd_stats.f++)
+#define STAT_ADD(f,n)   (sd_stats.f += (n))
+
+#endif
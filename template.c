@@ -31,6 +31,8 @@
 #include "template.h"
 #include "cprint.h"     /* Console printing direct to hardware */
 #include "sd.h"
+#include "cache.h"
+#include "stats.h"
 
 #ifdef USE_INTERNAL_STACK
 
@@ -48,12 +50,24 @@ extern bool debug;
 #endif // USE_INTERNAL_STACK
 
 request __far *fpRequest = (request __far *)0;
+void (__interrupt __far *old_int19)();   /* previous INT 19H vector contents */
+void (__interrupt __far *old_int28)();   /* previous INT 28H vector contents */
+void (__interrupt __far *old_int1c)();   /* previous INT 1CH vector contents */
+uint16_t idle_budget = IDLE_BUDGET_MS * VIA_TICKS_PER_MS; /* INT 28h slice */
+static volatile bool driver_busy = false;  /* Inside DeviceInterrupt */
+static volatile bool idle_busy = false;    /* Inside an idle slice */
+uint32_t tick_count = 0;                   /* INT 1Ch ticks, for the trace */
+SdStats sd_stats = {0};                    /* Operation counters (GET_STATS) */
+SdLatency sd_latency = {0};                /* Latency histograms (GET_LATENCY) */
 
 static uint16_t open( void )
 {
     return S_DONE;
 }
 
+/* DEVICE_ATTR leaves ATTR_EXCALLS clear, so DOS never sends OPEN or  */
+/* CLOSE.  Nothing may be flushed here: mediaCheck, INT 19h and the     */
+/* idle engine are where held back writes and open streams end.         */
 static uint16_t close( void )
 {
     return S_DONE;
@@ -74,10 +88,9 @@ static uint16_t mediaCheck (void)
   //fpRequest->r_mediaCheck = MK_FP(registers.es, registers.bx);
   //cdprintf("SD: mediaCheck: unit=%x\n", fpRequest->r_mc_vol_id);
   
-  writeToDriveLog("SD: mediaCheck(): r_unit 0x%2xh media_descriptor = 0x%2xh r_mc_red_code: %d fpRequest: %x:%x\n", 
-    fpRequest->r_unit, fpRequest->r_mc_media_desc, M_NOT_CHANGED,
-    FP_SEG(fpRequest), FP_OFF(fpRequest));
+  LOG4(LS_MEDIA_CHECK, fpRequest->r_unit, (uint8_t)fpRequest->r_mc_media_desc, M_NOT_CHANGED, fpRequest);
  
+  cache_flush();   /* Never leave a write held back or open across a media check */
   fpRequest->r_mc_ret_code = M_NOT_CHANGED;
   //fpRequest->r_mc_ret_code = sd_mediaCheck(*fpRequest->r_mc_vol_id) ? M_CHANGED : M_NOT_CHANGED;
   return S_DONE;
@@ -93,11 +106,7 @@ static uint16_t buildBpb (void)
   // cdprintf("SD: buildBpb()\n");
   // if (debug)
   //     cdprintf("SD: buildBpb: unit=%x\n", fpRequest->r_bpmdesc);
-  uint32_t bpb_start = calculateLinearAddress(FP_SEG(fpRequest->r_bpptr) , FP_OFF(fpRequest->r_bpptr));
-    
-  writeToDriveLog("SD: buildBpb(): media_descriptor=0x%2xh r_bpfat: %x:%x r_bpptr: %x:%x %5X", 
-      fpRequest->r_bpmdesc, FP_SEG(fpRequest->r_bpfat), FP_OFF(fpRequest->r_bpfat),
-      FP_SEG(fpRequest->r_bpptr), FP_OFF(fpRequest->r_bpptr), bpb_start);
+  LOG3(LS_BUILD_BPB, (uint8_t)fpRequest->r_bpmdesc, fpRequest->r_bpfat, fpRequest->r_bpptr);
   //we build the BPB during the deviceInit() method. just return pointer to built table
   fpRequest->r_bpptr = my_bpb_ptr;
 
@@ -107,15 +116,15 @@ static uint16_t buildBpb (void)
 
 static uint16_t IOCTLInput(void)
 {
-    struct ALL_REGS regs;
-    
-    get_all_registers(&regs);
+    //for the Victor disk IOCTL the datastructure is passed on thd DS:DX registers,
+    //which DOS hands to the driver as the request's transfer address
+    V9kDiskInfo far *v9k_disk_info_ptr = (V9kDiskInfo far *)fpRequest->r_trans;
+    SdCacheStats far *cache_stats_ptr = (SdCacheStats far *)fpRequest->r_trans;
 
-    //for the Victor disk IOCTL the datastructure is passed on thd DS:DX registers
-    V9kDiskInfo far *v9k_disk_info_ptr = MK_FP(regs.ds, regs.dx);
+    sd_sync(fpRequest->r_unit);   /* IOCTL ends any open transfer */
 
     //cdprintf("SD: IOCTLInput()");
-    writeToDriveLog("SD: IOCTLInput(): di_ioctl_type = 0x%xh\n", v9k_disk_info_ptr->di_ioctl_type);
+    LOG1(LS_IOCTL_IN, v9k_disk_info_ptr->di_ioctl_type);
     {
         switch (v9k_disk_info_ptr->di_ioctl_type)
         {
@@ -141,6 +150,38 @@ static uint16_t IOCTLInput(void)
             return S_DONE;
             break;
 
+        case GET_CACHE_STATS:
+            if (fpRequest->r_count < sizeof(SdCacheStats))
+                return (S_DONE | S_ERROR | E_HEADER_LENGTH);
+            cache_stats_ptr->cs_ioctl_status = 0;
+            cache_stats_ptr->cs_slots = cache_slots;
+            cache_stats_ptr->cs_hits = cache_hits;
+            cache_stats_ptr->cs_misses = cache_misses;
+            cache_stats_ptr->cs_prefetched = prefetch_count;
+            cache_stats_ptr->cs_prefetch_hits = prefetch_hits;
+            cache_stats_ptr->cs_prefetch_wasted = prefetch_wasted;
+            cache_stats_ptr->cs_pinned = pinned_count;
+            return S_DONE;
+            break;
+
+        case GET_LATENCY:
+            if (fpRequest->r_count < sizeof(SdLatency))
+                return (S_DONE | S_ERROR | E_HEADER_LENGTH);
+            _fmemcpy((uint8_t far *)fpRequest->r_trans + 2, (uint8_t far *)&sd_latency + 2,
+                     sizeof(SdLatency) - 2);
+            v9k_disk_info_ptr->di_ioctl_status = 0;
+            return S_DONE;
+            break;
+
+        case GET_STATS:
+            if (fpRequest->r_count < sizeof(SdStats))
+                return (S_DONE | S_ERROR | E_HEADER_LENGTH);
+            _fmemcpy((uint8_t far *)fpRequest->r_trans + 2, (uint8_t far *)&sd_stats + 2,
+                     sizeof(SdStats) - 2);
+            v9k_disk_info_ptr->di_ioctl_status = 0;
+            return S_DONE;
+            break;
+
         default:
             failed = true;
             v9k_disk_info_ptr->di_ioctl_status = failed;
@@ -152,6 +193,46 @@ static uint16_t IOCTLInput(void)
     return (S_DONE | S_ERROR | E_HEADER_LENGTH);
 }
 
+/* IOCTLOutput */
+/*   Lets a utility pin a range of sectors into the cache, or unpin it,   */
+/* through DOS function 4405h.  The request is an SdPinRequest, or just  */
+/* the two byte type/status header for RESET_STATS.                      */
+static uint16_t IOCTLOutput(void)
+{
+    SdPinRequest far *pin_ptr = (SdPinRequest far *)fpRequest->r_trans;
+
+    if (fpRequest->r_count < 2)
+        return (S_DONE | S_ERROR | E_HEADER_LENGTH);
+
+    LOG1(LS_IOCTL_OUT, pin_ptr->pr_ioctl_type);
+    switch (pin_ptr->pr_ioctl_type)
+    {
+    case RESET_STATS:
+        _fmemset(&sd_stats, 0, sizeof(sd_stats));
+        _fmemset(&sd_latency, 0, sizeof(sd_latency));
+        pin_ptr->pr_ioctl_status = 0;
+        return S_DONE;
+
+    case PIN_SECTORS:
+        if (fpRequest->r_count < sizeof(SdPinRequest))
+            return (S_DONE | S_ERROR | E_HEADER_LENGTH);
+        pin_ptr->pr_ioctl_status =
+            (cache_pin(fpRequest->r_unit, pin_ptr->pr_lbn, pin_ptr->pr_count) == RES_OK) ? 0 : 1;
+        return S_DONE;
+
+    case UNPIN_SECTORS:
+        if (fpRequest->r_count < sizeof(SdPinRequest))
+            return (S_DONE | S_ERROR | E_HEADER_LENGTH);
+        cache_unpin(pin_ptr->pr_lbn, pin_ptr->pr_count);
+        pin_ptr->pr_ioctl_status = 0;
+        return S_DONE;
+
+    default:
+        pin_ptr->pr_ioctl_status = 1;
+        return (S_DONE | S_ERROR | E_UNKNOWN_COMMAND);
+    }
+}
+
 /* dosError */
 /*   This routine will translate a SD error code into an appropriate  */
 /* DOS error code.  This driver never retries on any error condition.   */
@@ -172,7 +253,7 @@ int dosError (int status)
     case RES_PARERR: return E_CRC_ERROR;
 
     default:
-    writeToDriveLog("SD: unknown drive error - status = 0x%2x\n", status);
+    LOG1(LS_DRIVE_ERROR, status);
         return E_GENERAL_FAILURE;
   }
 }
@@ -187,37 +268,23 @@ unsigned get_stackpointer();
 static uint16_t readBlock (void)
 {
   // cdprintf("SD: readBlock()\n");
-  if (debug) {
-    writeToDriveLog("SD: read block: media_descriptor=0x%2xh, start=%d, count=%d, r_trans=%x:%x\n",
-     fpRequest->r_meddesc, fpRequest->r_start, fpRequest->r_count, 
-             FP_SEG(fpRequest->r_trans), FP_OFF(fpRequest->r_trans));
-  }
+  LOG4(LS_READ, fpRequest->r_start, fpRequest->r_count, fpRequest->r_trans, (uint8_t)fpRequest->r_meddesc);
   if (initNeeded)  return (S_DONE | S_ERROR | E_NOT_READY); //not initialized yet
 
-  uint16_t count; 
-  uint16_t numberOfSectorsToCopy = fpRequest->r_count;  
+  if (!fpRequest->r_count)  return (S_DONE);
+  LOG4(LS_ACCESS_READ, fpRequest->r_unit, fpRequest->r_start, fpRequest->r_count, tick_count);
 
-  if (initNeeded)  return (S_DONE | S_ERROR | E_NOT_READY); //not initialized yet
-  //TODO: double check all this math below. differs greatly across media
-  count = fpRequest->r_count,  
-          fpRequest->r_start;  
-  uint8_t far * dta = (uint8_t far *)fpRequest->r_trans;
-  uint32_t lbn = fpRequest->r_start;
-  while (count > 0) {
-      uint16_t sendct = (count > 16) ? 16 : count;
-      //int sd_read (uint16_t unit, uint32_t lbn, uint8_t far *buffer, uint16_t count)
-      int16_t status = sd_read(fpRequest->r_unit, lbn, dta, sendct);
-
-      if (status != RES_OK)  {
-        if (debug) cdprintf("SD: read error - status=%d\n", status);
-        //_fmemset(dta, 0, BLOCKSIZE);
-        return (S_DONE | S_ERROR | dosError(status));
-      }
-
-    lbn += sendct;
-    count -= sendct;
-    dta += (sendct*BLOCKSIZE);
+  /* The whole request goes out as one multi-block transfer; disk_read() */
+  /* steps the buffer by segment so the offset never wraps.              */
+  int16_t status = cache_read(fpRequest->r_unit, fpRequest->r_start,
+                              (uint8_t far *)fpRequest->r_trans, fpRequest->r_count);
+
+  if (status != RES_OK)  {
+    if (debug) cdprintf("SD: read error - status=%d\n", status);
+    LOG3(LS_READ_ERROR, status, fpRequest->r_start, fpRequest->r_count);
+    return (S_DONE | S_ERROR | dosError(status));
   }
+  STAT_ADD(st_sectors_read, fpRequest->r_count);
   return (S_DONE);
 }
 
@@ -226,38 +293,23 @@ static uint16_t readBlock (void)
 /* Write Data with Verification */
 static uint16_t write_block (bool verify)
 {
-  //TODO Double check this math, differs by media
-  uint32_t lbn;
-  uint16_t count;  
   int status; 
-  uint8_t far *dta;
-  uint16_t sendct;
-  bool success, hard_disk, left;
-
-  if (debug) {
-        writeToDriveLog("SD: write block: media_desc=%d, start=%d, count=%d, r_trans=%x:%x verify: %d fpRequest: %x:%x\n",
-                 fpRequest->r_meddesc, fpRequest->r_start, fpRequest->r_count, 
-                 FP_SEG(fpRequest->r_trans), FP_OFF(fpRequest->r_trans), verify, 
-                 FP_SEG(fpRequest), FP_OFF(fpRequest));
-  }
+
+  LOG4(LS_WRITE, fpRequest->r_start, fpRequest->r_count, fpRequest->r_trans, verify);
 
   if (initNeeded)  return (S_DONE | S_ERROR | E_NOT_READY); //not initialized yet
-  count = fpRequest->r_count;
-  dta = (uint8_t far *)fpRequest->r_trans;
-  lbn = fpRequest->r_start;
-  while (count > 0) {
-    sendct = (count > 16) ? 16 : count;
-    status = sd_write(fpRequest->r_unit, lbn, dta, sendct);
-
-    if (status != RES_OK)  {
-      if (debug) cdprintf("SD: write error - status=%d\n", status);
-      return (S_DONE | S_ERROR | dosError(status));
-    }
+  if (!fpRequest->r_count)  return (S_DONE);
+  LOG4(LS_ACCESS_WRITE, fpRequest->r_unit, fpRequest->r_start, fpRequest->r_count, tick_count);
+
+  status = cache_write(fpRequest->r_unit, fpRequest->r_start,
+                       (uint8_t far *)fpRequest->r_trans, fpRequest->r_count);
 
-    lbn += sendct;
-    count -= sendct;
-    dta += (sendct*BLOCKSIZE);
+  if (status != RES_OK)  {
+    if (debug) cdprintf("SD: write error - status=%d\n", status);
+    LOG3(LS_WRITE_ERROR, status, fpRequest->r_start, fpRequest->r_count);
+    return (S_DONE | S_ERROR | dosError(status));
   }
+  STAT_ADD(st_sectors_written, fpRequest->r_count);
   return (S_DONE);
 }
 
@@ -295,7 +347,7 @@ static driverFunction_t dispatchTable[] =
     writeVerify,         // 0x09 Output with verify
     NULL,                // 0x0A Output Status
     NULL,                // 0x0B Output Flush
-    NULL,                // 0x0C Ioctl Out
+    IOCTLOutput,         // 0x0C Ioctl Out
     open,                // 0x0D Device Open
     close,               // 0x0E Device Close
     NULL,                // 0x0F Removable MEDIA
@@ -313,6 +365,45 @@ static driverFunction_t dispatchTable[] =
 
 static driverFunction_t currentFunction;
 
+/* latencyRecord */
+/*   Files the request just completed under its command and, for reads  */
+/* and writes, under its transfer row.  blocks is how many sector data  */
+/* packets the request moved to or from the card; none means the cache  */
+/* served all of it.  Counting commands instead would file a request    */
+/* that only continued an open CMD18/CMD25 stream as a hit.             */
+static void latencyRecord (uint16_t ticks, uint16_t blocks)
+{
+    uint8_t command = fpRequest->r_command;
+    uint16_t t;
+    uint8_t bucket, row;
+
+    if (ticks == 0xFFFF) {
+        bucket = LAT_BUCKETS - 1;
+    } else {
+        for (bucket = 0, t = ticks >> LAT_MIN_SHIFT; t; t >>= 1) bucket++;
+    }
+    sd_latency.lt_command[command][bucket]++;
+
+    if (command == C_INPUT || command == C_OUTPUT || command == C_OUTVFY) {
+        row = (command == C_INPUT) ? 0 : LAT_WRITE;
+        if (blocks) row |= LAT_MISS;
+        if (fpRequest->r_count > 1) row |= LAT_MULTI;
+        sd_latency.lt_transfer[row][bucket]++;
+    }
+
+    if (ticks >= sd_latency.lt_worst_ticks) {
+        sd_latency.lt_worst_ticks = ticks;
+        sd_latency.lt_worst_command = command;
+        if (command == C_INPUT || command == C_OUTPUT || command == C_OUTVFY) {
+            sd_latency.lt_worst_lbn = fpRequest->r_start;
+            sd_latency.lt_worst_count = fpRequest->r_count;
+        } else {
+            sd_latency.lt_worst_lbn = 0;
+            sd_latency.lt_worst_count = 0;
+        }
+    }
+}
+
 void __far DeviceInterrupt( void )
 #pragma aux DeviceInterrupt __parm []
 {
@@ -321,6 +412,7 @@ void __far DeviceInterrupt( void )
 #endif
 
     push_regs();
+    driver_busy = true;           /* Keep the idle engine out (DS is ours now) */
 
     if ( fpRequest->r_command > C_MAXCMD || NULL == (currentFunction = dispatchTable[fpRequest->r_command]) )
     {
@@ -331,7 +423,14 @@ void __far DeviceInterrupt( void )
         // writeToDriveLog("SD: DeviceInterrupt command: %d r_unit: 0x%2xh isMyUnit(): %d r_status: %d r_length: %d initNeeded: %d\n",
         //     fpRequest->r_command, fpRequest->r_unit, isMyUnit(fpRequest->r_unit), fpRequest->r_status, fpRequest->r_length, initNeeded);   
         if ((initNeeded && fpRequest->r_command == C_INIT) || isMyUnit(fpRequest->r_unit)) {
+            uint16_t blocks = data_blocks;
+
+            via_timer_start();    /* VIA timer 2 times the request */
             fpRequest->r_status = currentFunction();
+            latencyRecord(via_timer_elapsed(), data_blocks - blocks);
+            STAT_INC(st_requests[fpRequest->r_command]);
+            if (fpRequest->r_status & S_ERROR)
+                STAT_INC(st_errors[fpRequest->r_status & 0x0F]);
         } else {
             // This is  not for me to handle
             struct device_header __far *deviceHeader = MK_FP(getCS(), 0);
@@ -340,6 +439,11 @@ void __far DeviceInterrupt( void )
         }
     }
 
+    /* Full trace sectors go out here only if no stream would be broken; */
+    /* otherwise they wait for the idle engine (idleSlice).              */
+    if (!disk_streaming())
+        flushDriveLog(FALSE, 0);
+    driver_busy = false;
     pop_regs();
 
 #ifdef USE_INTERNAL_STACK
@@ -347,6 +451,76 @@ void __far DeviceInterrupt( void )
 #endif
 }
 
+/* rebootHandler */
+/*   Hooked on INT 19h when write-back caching is on, so that a reboot   */
+/* does not throw away sectors that are still only in the cache.  Runs  */
+/* on the internal stack like a driver request, then chains on.         */
+void __interrupt __far rebootHandler( void )
+{
+#ifdef USE_INTERNAL_STACK
+    switch_stack();
+#endif
+
+    cache_flush();
+
+#ifdef USE_INTERNAL_STACK
+    restore_stack();
+#endif
+    _chain_intr(old_int19);
+}
+
+/* idleSlice */
+/*   Runs one bounded slice of background work, unless DOS is inside the */
+/* driver or another slice is already running (INT 1Ch can fire in the  */
+/* middle of an INT 28h slice).  The slice runs on the internal stack,   */
+/* which is free whenever DeviceInterrupt is not active.  SS == CS       */
+/* catches a tick that lands after DeviceInterrupt has switched to that  */
+/* stack but before it could set driver_busy.  This is where the trace  */
+/* is written out while DOS keeps a CMD18/CMD25 going from request to   */
+/* request, since a flush at the end of a request would tear it down.   */
+/* flush_all also writes the partly filled sector; otherwise only full  */
+/* ones go.  The trace is only started while at least half the budget   */
+/* is left, and then only gets what cache_idle() did not use.           */
+static void idleSlice( uint16_t budget, bool flush_all )
+{
+    uint16_t left;
+
+    if (driver_busy || idle_busy || initNeeded || getSS() == getCS())
+        return;
+    idle_busy = true;
+#ifdef USE_INTERNAL_STACK
+    switch_stack();
+#endif
+
+    left = cache_idle(budget);
+    if (left && left >= budget / 2)
+        flushDriveLog(flush_all, left);
+
+#ifdef USE_INTERNAL_STACK
+    restore_stack();
+#endif
+    idle_busy = false;
+}
+
+/* idleHandler */
+/*   INT 28h: DOS is idle, typically waiting for a key at the prompt.    */
+void __interrupt __far idleHandler( void )
+{
+    idleSlice(idle_budget, TRUE);
+    _chain_intr(old_int28);
+}
+
+/* tickHandler */
+/*   INT 1Ch: timer tick.  This runs inside the timer interrupt, so it   */
+/* only gets a quarter of the idle budget and writes out only full      */
+/* trace sectors.  It also keeps tick_count for the access records.     */
+void __interrupt __far tickHandler( void )
+{
+    tick_count++;
+    idleSlice(idle_budget >> 2, FALSE);
+    _chain_intr(old_int1c);
+}
+
 void __far DeviceStrategy( request __far *req )
 #pragma aux DeviceStrategy __parm [__es __bx]
 {
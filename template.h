@@ -84,6 +84,23 @@ extern void restore_stack( void );
 
 #endif /* USE_INTERNAL_STACK */
 
+extern void (__interrupt __far *old_int19)();
+extern void __interrupt __far rebootHandler( void );
+
+/* Idle-time engine: INT 28h gets idle_budget VIA ticks per call, INT 1Ch */
+/* a quarter of that.  /I=n sets the budget in ms, 0 leaves both unhooked. */
+#define VIA_TICKS_PER_MS 1000    /* 1 MHz VIA clock */
+#define IDLE_BUDGET_MS   20
+extern uint16_t idle_budget;
+extern void (__interrupt __far *old_int28)();
+extern void (__interrupt __far *old_int1c)();
+extern void __interrupt __far idleHandler( void );
+extern void __interrupt __far tickHandler( void );
+
+/* INT 1Ch ticks counted by tickHandler, the clock of the access trace. */
+/* Stays 0 when the idle engine is off (/I=0 or nothing to do idle).    */
+extern uint32_t tick_count;
+
 extern void push_regs( void );
 #pragma aux push_regs = \
     "pushf" \
@@ -105,6 +122,10 @@ extern __segment getCS( void );
 #pragma aux getCS = \
     "mov ax, cs";
 
+extern __segment getSS( void );
+#pragma aux getSS = \
+    "mov ax, ss";
+
 extern void get_segments(struct SREGS far *sregs);
 #pragma aux get_segments = \
     "mov ax, cs" \